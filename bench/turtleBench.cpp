@@ -0,0 +1,173 @@
+// Microbenchmark of the turtle.
+// Compares the former rotations of the turtle, around an axis computed in world
+// space with a sin and a cos on every op, against the precomputed local-frame
+// quaternions of the compiled grammar. Then measures the whole parser.
+#include "lParser.hpp"
+#include "lTurtle.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace lParser;
+
+// Turtle as it was before the rotation table
+struct WorldTurtle {
+    glm::vec3 pos = glm::vec3(0);
+    glm::quat rotation = glm::quat(1.f, glm::vec3(0.f));
+
+    glm::vec3 forward() const { return glm::rotate(rotation, glm::vec3(0.f, 1.f, 0.f)); }
+    glm::vec3 left() const { return glm::rotate(rotation, glm::vec3(-1.f, 0.f, 0.f)); }
+    glm::vec3 up() const { return glm::rotate(rotation, glm::vec3(0.f, 0.f, 1.f)); }
+
+    void rotateArround(float angle, glm::vec3 axis)
+    {
+        float sinA = std::sin(angle * 0.5f);
+        float cosA = std::cos(angle * 0.5f);
+        rotation = glm::quat(cosA, axis * sinA) * rotation;
+
+        float dot = glm::dot(rotation, rotation);
+        if (std::abs(dot - 1.0f) > 1e-4) {
+            rotation = rotation / std::sqrt(dot);
+        }
+    }
+};
+
+double elapsedNs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+void benchTurtle() {
+    const uint32_t numOps = 1 << 24;
+    const float angle = glm::radians(22.5f);
+
+    // Random sequence of the 6 rotation operators
+    std::mt19937 rng(1234);
+    std::vector<uint8_t> ops(numOps);
+    for (uint8_t& op : ops) {
+        op = (uint8_t)(rng() % 6);
+    }
+
+    WorldTurtle world;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (uint8_t op : ops) {
+        const float a = (op & 1) ? -angle : angle;
+        switch (op >> 1) {
+        case 0: world.rotateArround(a, world.up()); break;
+        case 1: world.rotateArround(a, world.forward()); break;
+        default: world.rotateArround(a, world.left()); break;
+        }
+    }
+    const double worldNs = elapsedNs(start) / numOps;
+
+    const glm::vec3 axes[] = { glm::vec3(0.f, 0.f, 1.f), glm::vec3(0.f, 1.f, 0.f), glm::vec3(-1.f, 0.f, 0.f) };
+    glm::quat table[6];
+    for (uint32_t i = 0; i < 6; ++i) {
+        const float a = (i & 1) ? -angle : angle;
+        table[i] = glm::quat(std::cos(a * 0.5f), axes[i >> 1] * std::sin(a * 0.5f));
+    }
+    Turtle local;
+    start = std::chrono::steady_clock::now();
+    for (uint8_t op : ops) {
+        local.rotateLocal(table[op]);
+    }
+    const double localNs = elapsedNs(start) / numOps;
+
+    // Both turtles follow the same orientations, but the rounding errors of so many ops
+    // add up, so check them on a short sequence
+    WorldTurtle worldCheck;
+    Turtle localCheck;
+    float maxDifference = 0.f;
+    for (uint32_t i = 0; i < 1024; ++i) {
+        const uint8_t op = ops[i];
+        const float a = (op & 1) ? -angle : angle;
+        switch (op >> 1) {
+        case 0: worldCheck.rotateArround(a, worldCheck.up()); break;
+        case 1: worldCheck.rotateArround(a, worldCheck.forward()); break;
+        default: worldCheck.rotateArround(a, worldCheck.left()); break;
+        }
+        localCheck.rotateLocal(table[op]);
+        maxDifference = std::max(maxDifference, glm::length(worldCheck.forward() - localCheck.forward()));
+    }
+
+    std::printf("Turtle rotation, %u ops (checksum %g)\n", numOps,
+        glm::length(world.forward()) + glm::length(local.forward()));
+    std::printf("  world axis, sin/cos per op: %6.2f ns/op\n", worldNs);
+    std::printf("  local frame table:          %6.2f ns/op\n", localNs);
+    std::printf("  max difference in 1024 ops: %g\n", maxDifference);
+}
+
+void benchParser(const char* name, LParserInfo info) {
+    // Random values keyed by path, so the model is the same with any number of threads
+    info.rngMode = RngMode::PathHashed;
+    const uint32_t maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    double sequentialSeconds = 0.0;
+    for (uint32_t threads = 1; threads <= maxThreads; threads *= 2) {
+        info.numThreads = threads;
+        LParserOut out;
+        std::string err;
+        if (!parse(info, &out, &err)) {
+            std::printf("%s: %s\n", name, err.c_str());
+            return;
+        }
+        if (threads == 1) {
+            sequentialSeconds = out.stats.seconds;
+        }
+        std::printf("  %-10s %2u threads %10zu cylinders %8.2f ms %6.2f ns/symbol, %5u tasks, speedup %.2f\n",
+            name, threads, out.cylinders.size(), out.stats.seconds * 1e3, out.stats.nsPerSymbol(),
+            out.stats.tasks, sequentialSeconds / out.stats.seconds);
+    }
+}
+
+int main() {
+    benchTurtle();
+
+    std::printf("Parser\n");
+    LParserInfo info;
+    info.axiom = "F";
+    info.rules = { {"F", "FF>-[F&+F+F]+[+F^-F-F]"} };
+    info.maxRecursionLevel = 7;
+    info.defaultThickness = 0.3f;
+    info.thicknessReductionFactor = 0.98f;
+    benchParser("Algae", info);
+
+    info = LParserInfo();
+    info.axiom = "A";
+    info.rules = { {"A", "[&FL>A]/////[&FL>A]///////[&FL>A]"},
+                    {"F", "S/////F"},
+                    {"S", "FL"},
+                    {"L", "[^^<[-f+f+f-|-f+f+f]]"}
+    };
+    info.maxRecursionLevel = 9;
+    info.defaultAngle = 22.5f;
+    info.defaultThickness = 0.3f;
+    benchParser("Plant", info);
+
+    info = LParserInfo();
+    info.axiom = "F(200)/(45)A";
+    info.constants = { {"d1", 94.74f}, {"d2", 132.63f}, {"a", 18.95f} };
+    info.rules = { {"A", ">F(50)[&(a)F(50)A]/(d1)[&(a)F(50)A]/(d2)[&(a)F(50)A]"} };
+    info.maxRecursionLevel = 13;
+    info.defaultThickness = 15.f;
+    benchParser("Tree", info);
+
+    info = LParserInfo();
+    info.axiom = "X";
+    info.rules = { {"F", "F>"},
+                    {"X", 0.25f, "F-[\\(35)[X]+X]+F[+FX]-X"},
+                    {"X", 0.25f, "F-[[X]+X]+F[\\(15)+FX]-X"},
+                    {"X", 0.25f, "F-[/(15)[X]+X]+F[+FX]-X"},
+                    {"X", 0.25f, "F-[[X]+X]+F[/(30)+FX]-X"}
+    };
+    info.maxRecursionLevel = 9;
+    info.defaultAngle = 25.7f;
+    info.defaultThickness = 0.5f;
+    info.thicknessReductionFactor = 0.9f;
+    benchParser("Fan", info);
+
+    return 0;
+}
@@ -0,0 +1,269 @@
+#include "ParseWorker.hpp"
+
+#include "lSink.hpp"
+
+// Sink that queues the batches in the worker, waiting while the queue is full
+class ParseWorker::QueueSink : public lParser::CylinderSink {
+public:
+	explicit QueueSink(ParseWorker* worker) : mWorker(worker) {}
+
+	bool consume(const lParser::Cylinder* cylinders, size_t count, std::string* /*outErr*/) override
+	{
+		std::unique_lock<std::mutex> lock(mWorker->mMutex);
+		mWorker->mChunkTaken.wait(lock, [this]() {
+			return mWorker->mChunks.size() < MAX_QUEUED_CHUNKS || mWorker->mCancel.load();
+		});
+		// Once cancelled the chunks are dropped, the generation stops at the next check of the limits
+		if (!mWorker->mCancel.load()) {
+			mWorker->mChunks.emplace_back(cylinders, cylinders + count);
+		}
+		return true;
+	}
+
+private:
+	ParseWorker* mWorker;
+};
+
+ParseWorker::~ParseWorker()
+{
+	stop();
+}
+
+void ParseWorker::start(const lParser::Grammar& grammar, Output output, const lParser::ParseLimits& limits, bool merge)
+{
+	stop();
+	mGrammar = grammar;
+	mLimits = limits;
+	mLimits.cancel = &mCancel;
+	mLimits.progress = &mProgress;
+	mCancel = false;
+	mProgress.symbols = 0;
+	mProgress.cylinders = 0;
+	mDone = false;
+	mResult = Result();
+	mThread = std::thread(&ParseWorker::run, this, output, merge);
+}
+
+void ParseWorker::startExport(const lParser::Grammar& grammar, const std::string& path,
+	const lParser::ParseLimits& limits, bool merge)
+{
+	stop();
+	mPath = path;
+	start(grammar, Output::File, limits, merge);
+}
+
+void ParseWorker::cancel()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mCancel = true;
+	}
+	mChunkTaken.notify_all();
+}
+
+void ParseWorker::stop()
+{
+	if (!mThread.joinable()) {
+		return;
+	}
+	cancel();
+	mThread.join();
+	mChunks.clear();
+}
+
+void ParseWorker::takeChunks(size_t maxChunks, std::vector<std::vector<lParser::Cylinder>>* chunks)
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		for (size_t i = 0; i < maxChunks && !mChunks.empty(); ++i) {
+			chunks->push_back(std::move(mChunks.front()));
+			mChunks.pop_front();
+		}
+	}
+	mChunkTaken.notify_all();
+}
+
+bool ParseWorker::reusesDerivation(const lParser::Grammar& grammar) const
+{
+	if (!grammar.stochastic || grammar.rngMode == lParser::RngMode::PathHashed) {
+		return lParser::derivationKey(grammar, 0) == mLevelsKey.load();
+	}
+	return lParser::derivationKey(grammar) == mDerivationKey.load();
+}
+
+bool ParseWorker::takeResult(Result* result)
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (!mThread.joinable() || !mDone || !mChunks.empty()) {
+			return false;
+		}
+		*result = std::move(mResult);
+	}
+	mThread.join();
+	return true;
+}
+
+void ParseWorker::run(Output output, bool merge)
+{
+	Result result;
+	result.output = output;
+	if (output == Output::Instanced) {
+		result.ok = lParser::parseInstanced(mGrammar, &result.instanced, &result.error, mLimits);
+		result.stats = result.instanced.stats;
+	}
+	else if (output == Output::Skeleton) {
+		result.ok = generateSkeleton(&result);
+	}
+	else if (output == Output::File) {
+		lParser::FileSink file(mPath);
+		lParser::MergeSink merger(&file);
+		result.ok = lParser::parse(mGrammar, merge ? (lParser::CylinderSink*)&merger : &file,
+			&result.stats, &result.error, mLimits);
+		result.merged = merge;
+		result.mergedCylinders = merge ? merger.getOutputCount() : 0;
+		result.writtenCylinders = file.getCount();
+	}
+	else {
+		QueueSink queue(this);
+		lParser::CompactSink compact(&result.compact);
+		lParser::CylinderSink* target = output == Output::Compact ? (lParser::CylinderSink*)&compact : &queue;
+		lParser::MergeSink merger(target);
+		result.ok = generate(merge ? &merger : target, &result);
+		if (merge) {
+			result.merged = true;
+			result.mergedCylinders = merger.getOutputCount();
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	mResult = std::move(result);
+	mDone = true;
+}
+
+bool ParseWorker::estimate(lParser::ParseEstimate* estimation, Result* result)
+{
+	if (lParser::estimate(mGrammar, estimation, mLimits)) {
+		return true;
+	}
+	result->stats.result = mCancel.load() ? lParser::ParseResult::Cancelled : lParser::ParseResult::TimeLimit;
+	result->error = lParser::limitMessage(result->stats.result);
+	return false;
+}
+
+bool ParseWorker::generate(lParser::CylinderSink* sink, Result* result)
+{
+	lParser::ParseEstimate estimation;
+	if (!estimate(&estimation, result)) {
+		return false;
+	}
+	// The kept levels below the last one take about as much as it
+	if (2 * estimation.symbols > MAX_DERIVATION_BYTES / sizeof(uint32_t)) {
+		return lParser::parse(mGrammar, sink, &result->stats, &result->error, mLimits);
+	}
+
+	const lParser::Derivation* derivation = nullptr;
+	if (!derive(result, &derivation)) {
+		return false;
+	}
+
+	std::string interpretErr;
+	if (!lParser::interpret(mGrammar, *derivation, sink, &result->stats, &interpretErr, mLimits)) {
+		result->error = interpretErr;
+		return false;
+	}
+	// A partial derivation ends with the limit that stopped it
+	if (derivation->key == 0) {
+		result->stats.result = derivation->stats.result;
+		return false;
+	}
+	return true;
+}
+
+bool ParseWorker::generateSkeleton(Result* result)
+{
+	lParser::ParseEstimate estimation;
+	if (!estimate(&estimation, result)) {
+		return false;
+	}
+	if (2 * estimation.symbols > MAX_DERIVATION_BYTES / sizeof(uint32_t)) {
+		const bool ok = lParser::parseSkeleton(mGrammar, &result->skeleton, &result->error, mLimits);
+		result->stats = result->skeleton.stats;
+		return ok;
+	}
+
+	const lParser::Derivation* derivation = nullptr;
+	if (!derive(result, &derivation)) {
+		return false;
+	}
+
+	std::string buildErr;
+	const bool built = lParser::buildSkeleton(mGrammar, *derivation, &result->skeleton, &buildErr, mLimits);
+	result->stats = result->skeleton.stats;
+	if (!built) {
+		result->error = buildErr;
+		return false;
+	}
+	// A partial derivation ends with the limit that stopped it
+	if (derivation->key == 0) {
+		result->stats.result = derivation->stats.result;
+		return false;
+	}
+	return true;
+}
+
+bool ParseWorker::derive(Result* result, const lParser::Derivation** derivation)
+{
+	const bool byLevels = !mGrammar.stochastic || mGrammar.rngMode == lParser::RngMode::PathHashed;
+	if (!(byLevels ? deriveLevels(result, derivation) : deriveWhole(result, derivation))) {
+		return false;
+	}
+	mProgress.symbols = 0;
+	mProgress.cylinders = 0;
+	return true;
+}
+
+bool ParseWorker::deriveLevels(Result* result, const lParser::Derivation** derivation)
+{
+	mDerivationKey = 0;
+	mLevelsKey = 0;
+	mDerivation.reset();
+	result->reusedDerivation = mLevels.key == lParser::derivationKey(mGrammar, 0) &&
+		mGrammar.maxRecursionLevel < mLevels.levels.size();
+	lParser::ParseStats stats;
+	const bool derived = lParser::deriveLevel(mGrammar, &mLevels, derivation, &stats, &result->error, mLimits);
+	// The levels derived before the stop are kept, but there is no partial model
+	mLevelsKey = mLevels.key;
+	result->deriveSeconds = stats.seconds;
+	if (!derived) {
+		result->stats = stats;
+		return false;
+	}
+	mDerivationKey = (*derivation)->key;
+	return true;
+}
+
+bool ParseWorker::deriveWhole(Result* result, const lParser::Derivation** derivation)
+{
+	mLevelsKey = 0;
+	mLevels = lParser::DerivationLevels();
+	const uint64_t key = lParser::derivationKey(mGrammar);
+	result->reusedDerivation = mDerivation && mDerivation->key == key;
+	if (!result->reusedDerivation) {
+		mDerivationKey = 0;
+		if (!mDerivation) {
+			mDerivation.reset(new lParser::Derivation());
+		}
+		const bool derived = lParser::derive(mGrammar, mDerivation.get(), &result->error, mLimits);
+		result->deriveSeconds = mDerivation->stats.seconds;
+		// A derivation stopped by a limit is still interpreted, to show the partial model
+		const lParser::ParseResult stop = mDerivation->stats.result;
+		if (!derived && (stop == lParser::ParseResult::GrammarError || stop == lParser::ParseResult::Cancelled)) {
+			result->stats = mDerivation->stats;
+			return false;
+		}
+		mDerivationKey = mDerivation->key;
+	}
+	*derivation = mDerivation.get();
+	return true;
+}
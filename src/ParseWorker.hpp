@@ -0,0 +1,126 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include "lParser.hpp"
+#include "lGrammar.hpp"
+#include "lInstanced.hpp"
+#include "lSkeleton.hpp"
+#include "lCompact.hpp"
+#include "lAnalysis.hpp"
+
+// Generates a model in a background thread, so the UI does not freeze on big grammars.
+// The cylinders of flat models are queued in chunks, to be uploaded to the GPU from the
+// thread of the OpenGL context while the model is generated.
+// The derivation of the last flat model is kept, so a model whose grammar only changed
+// its parameters (angles, thicknesses and constants) is interpreted again without rewriting.
+// Deterministic grammars, and the ones with RngMode::PathHashed, keep every level of the
+// derivation, so changing the recursion level only rewrites the levels not derived yet.
+// Skeletons are built from the same kept derivations, and returned whole with the result,
+// as the quantized models.
+class ParseWorker {
+public:
+	// Kind of model generated
+	enum class Output {
+		Cylinders,  // flat, queued in chunks
+		Instanced,  // repeated subtrees as instances
+		Skeleton,   // nodes shared by the segments
+		Compact,    // quantized, see lCompact.hpp
+		File        // written to a file as a FileSink, nothing is kept
+	};
+
+	// End of a generation
+	struct Result {
+		bool ok = false;
+		std::string error;
+		Output output = Output::Cylinders;
+		lParser::ParseStats stats;
+		lParser::InstancedOut instanced; // only for instanced generations
+		lParser::SkeletonOut skeleton;   // only for skeleton generations
+		lParser::CompactCylinders compact; // only for compact generations
+		bool merged = false;             // the cylinders went through a MergeSink
+		uint64_t mergedCylinders = 0;    // cylinders left by the merge, stats has the generated ones
+		uint64_t writtenCylinders = 0;   // only for file generations
+		bool reusedDerivation = false;   // the rewriting stage was skipped
+		double deriveSeconds = 0.0;      // time of the rewriting stage, if it was run
+	};
+
+	// Chunks waiting to be taken, the generation waits when there are more
+	static const size_t MAX_QUEUED_CHUNKS = 32;
+	// Derivations are only kept up to this size, bigger models are generated without them
+	static const uint64_t MAX_DERIVATION_BYTES = 1 << 28;
+
+	ParseWorker() = default;
+	~ParseWorker();
+
+	ParseWorker(const ParseWorker&) = delete;
+	ParseWorker& operator=(const ParseWorker&) = delete;
+
+	// Start generating a copy of the grammar. Instanced, skeleton and compact models are
+	// not queued, they are returned whole with the result. The limits can not have a cancel
+	// flag or a progress, the worker uses its own. With merge, the queued or quantized
+	// cylinders are the ones of a MergeSink.
+	void start(const lParser::Grammar& grammar, Output output, const lParser::ParseLimits& limits, bool merge = false);
+	// Start writing the cylinders of a copy of the grammar to a file, without keeping its derivation.
+	// A stopped generation leaves a valid file with the cylinders generated until then.
+	void startExport(const lParser::Grammar& grammar, const std::string& path, const lParser::ParseLimits& limits,
+		bool merge = false);
+	// Ask the generation to stop, it will end with ParseResult::Cancelled
+	void cancel();
+	// Cancel the generation and wait for it, dropping its chunks and its result
+	void stop();
+
+	// A generation has been started, and its result has not been taken yet
+	bool isRunning() const { return mThread.joinable(); }
+	// Interpreted symbols and generated cylinders of the running generation, updated from time to time
+	uint64_t getSymbols() const { return mProgress.symbols.load(std::memory_order_relaxed); }
+	uint64_t getCylinders() const { return mProgress.cylinders.load(std::memory_order_relaxed); }
+	// derivationKey of the last interpreted derivation, or 0
+	uint64_t getDerivationKey() const { return mDerivationKey.load(); }
+	// A generation of the grammar would reuse the kept derivation, or its kept levels
+	bool reusesDerivation(const lParser::Grammar& grammar) const;
+	// Memory of the kept derivations. Only valid while no generation is running.
+	size_t getDerivationBytes() const { return (mDerivation ? mDerivation->bytes() : 0) + mLevels.bytes(); }
+
+	// Move up to maxChunks queued chunks, in order, to the end of chunks
+	void takeChunks(size_t maxChunks, std::vector<std::vector<lParser::Cylinder>>* chunks);
+	// If the generation has ended and all its chunks have been taken, move its result
+	// and return true
+	bool takeResult(Result* result);
+
+private:
+	class QueueSink;
+
+	std::thread mThread;
+	std::mutex mMutex;
+	std::condition_variable mChunkTaken;
+	std::deque<std::vector<lParser::Cylinder>> mChunks;
+	bool mDone = false;
+	Result mResult;
+
+	lParser::Grammar mGrammar;
+	lParser::ParseLimits mLimits;
+	std::string mPath; // of file generations
+	std::atomic<bool> mCancel{ false };
+	lParser::ParseProgress mProgress;
+	// Only used by the thread of the generation
+	std::unique_ptr<lParser::Derivation> mDerivation;
+	lParser::DerivationLevels mLevels;
+	std::atomic<uint64_t> mDerivationKey{ 0 };
+	std::atomic<uint64_t> mLevelsKey{ 0 };    // key of the kept levels
+
+	void run(Output output, bool merge);
+	// Estimate the model under the limits, the result has the limit that stopped it
+	bool estimate(lParser::ParseEstimate* estimation, Result* result);
+	bool generate(lParser::CylinderSink* sink, Result* result);
+	bool generateSkeleton(Result* result);
+	bool derive(Result* result, const lParser::Derivation** derivation);
+	bool deriveLevels(Result* result, const lParser::Derivation** derivation);
+	bool deriveWhole(Result* result, const lParser::Derivation** derivation);
+};
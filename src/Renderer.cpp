@@ -1,7 +1,11 @@
 #include "Renderer.hpp"
 
 #include <iostream>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
 #include <glad/glad.h>
+#include <glm/gtx/quaternion.hpp>
 
 
 
@@ -33,20 +37,36 @@ void CheckGLError()
 }
 
 
+// Each cylinder is a line of two vertices
+struct VertexData {
+	glm::vec3 pos;
+	float width;
+};
+static_assert(sizeof(VertexData) == sizeof(glm::vec4), "Streamed vertices are built as vec4");
+
+// Each instance has a rotation quaternion, and a translation with the scale of the width
+struct GpuInstance {
+	glm::vec4 rotation;
+	glm::vec4 translation;
+};
+
 static const char* VERTEX_SHADER = 
 	"#version 330 core\n"
 	"#extension GL_ARB_explicit_uniform_location : enable\n"
 	"layout(location = 0) in vec3 aPos;\n"
 	"layout(location = 1) in float aWidth;\n"
+	"layout(location = 2) in vec4 aRotation;\n"
+	"layout(location = 3) in vec4 aTranslation;\n"
 	"layout(location = 0) uniform mat4 MVP;\n"
+	"vec3 rotate(vec4 q, vec3 v) { return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v); }\n"
 	"void main()\n"
 	"{\n"
-	"	gl_Position = MVP * vec4(aPos, 1.0);\n"
+	"	gl_Position = MVP * vec4(aTranslation.xyz + rotate(aRotation, aPos), 1.0);\n"
 	"}\n";
 static const char* FRAGMENT_SHADER =
 	"#version 330 core\n"
-	"out vec4 FragColor;\n"
 	"#extension GL_ARB_explicit_uniform_location : enable\n"
+	"out vec4 FragColor;\n"
 	"layout(location = 1) uniform vec3 color;\n"
 	"void main()\n"
 	"{\n"
@@ -57,13 +77,16 @@ static const char* VERTEX_SHADER_C =
 	"#version 330 core\n"
 	"layout(location = 0) in vec3 aPos;\n"
 	"layout(location = 1) in float aWidth;\n"
+	"layout(location = 2) in vec4 aRotation;\n"
+	"layout(location = 3) in vec4 aTranslation;\n"
 	"out VS_OUT {\n"
 	"	float width;\n"
 	"} vs_out;\n"
+	"vec3 rotate(vec4 q, vec3 v) { return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v); }\n"
 	"void main()\n"
 	"{\n"
-	"	gl_Position = vec4(aPos, 1.0);\n"
-	"	vs_out.width = aWidth;\n"
+	"	gl_Position = vec4(aTranslation.xyz + rotate(aRotation, aPos), 1.0);\n"
+	"	vs_out.width = aWidth * aTranslation.w;\n"
 	"}\n";
 // Extracted from https://github.com/torbjoern/polydraw_scripts/blob/master/geometry/drawcone_geoshader.pss
 static const char* GEOMETRY_SHADER_C =
@@ -109,6 +132,95 @@ static const char* GEOMETRY_SHADER_C =
 	"EndPrimitive();"
 	"}\n";
 
+// Decode of the cylinders of lCompact.hpp. A cylinder is an instance, and its chunk has three
+// texels: the origin and the length step, the position step and the log2 of the lowest width,
+// and the log2 step of the width.
+static const char* VERTEX_SHADER_COMPACT =
+	"#version 330 core\n"
+	"#extension GL_ARB_explicit_uniform_location : enable\n"
+	"layout(location = 4) in uvec4 aPositionLength;\n"
+	"layout(location = 5) in ivec2 aDirection;\n"
+	"layout(location = 6) in uint aWidth;\n"
+	"layout(location = 0) uniform mat4 MVP;\n"
+	"layout(location = 3) uniform samplerBuffer chunks;\n"
+	"vec3 decodeDirection(ivec2 e)\n"
+	"{\n"
+	"	vec2 f = max(vec2(e) / 32767.0, -1.0);\n"
+	"	vec3 n = vec3(f, 1.0 - abs(f.x) - abs(f.y));\n"
+	"	float t = max(-n.z, 0.0);\n"
+	"	n.xy += mix(vec2(t), vec2(-t), greaterThanEqual(n.xy, vec2(0.0)));\n"
+	"	return normalize(n);\n"
+	"}\n"
+	"void main()\n"
+	"{\n"
+	"	int chunk = 3 * (gl_InstanceID / 4096);\n"
+	"	vec4 a = texelFetch(chunks, chunk);\n"
+	"	vec4 b = texelFetch(chunks, chunk + 1);\n"
+	"	vec3 pos = a.xyz + vec3(aPositionLength.xyz) * b.xyz;\n"
+	"	if (gl_VertexID == 1) {\n"
+	"		pos += decodeDirection(aDirection) * (float(aPositionLength.w) * a.w);\n"
+	"	}\n"
+	"	gl_Position = MVP * vec4(pos, 1.0);\n"
+	"}\n";
+static const char* VERTEX_SHADER_COMPACT_C =
+	"#version 330 core\n"
+	"#extension GL_ARB_explicit_uniform_location : enable\n"
+	"layout(location = 4) in uvec4 aPositionLength;\n"
+	"layout(location = 5) in ivec2 aDirection;\n"
+	"layout(location = 6) in uint aWidth;\n"
+	"layout(location = 3) uniform samplerBuffer chunks;\n"
+	"out VS_OUT {\n"
+	"	float width;\n"
+	"} vs_out;\n"
+	"vec3 decodeDirection(ivec2 e)\n"
+	"{\n"
+	"	vec2 f = max(vec2(e) / 32767.0, -1.0);\n"
+	"	vec3 n = vec3(f, 1.0 - abs(f.x) - abs(f.y));\n"
+	"	float t = max(-n.z, 0.0);\n"
+	"	n.xy += mix(vec2(t), vec2(-t), greaterThanEqual(n.xy, vec2(0.0)));\n"
+	"	return normalize(n);\n"
+	"}\n"
+	"void main()\n"
+	"{\n"
+	"	int chunk = 3 * (gl_InstanceID / 4096);\n"
+	"	vec4 a = texelFetch(chunks, chunk);\n"
+	"	vec4 b = texelFetch(chunks, chunk + 1);\n"
+	"	float logWidthStep = texelFetch(chunks, chunk + 2).x;\n"
+	"	vec3 pos = a.xyz + vec3(aPositionLength.xyz) * b.xyz;\n"
+	"	if (gl_VertexID == 1) {\n"
+	"		pos += decodeDirection(aDirection) * (float(aPositionLength.w) * a.w);\n"
+	"	}\n"
+	"	gl_Position = vec4(pos, 1.0);\n"
+	"	vs_out.width = aWidth == 0u ? 0.0 : exp2(b.w + float(aWidth - 1u) * logWidthStep);\n"
+	"}\n";
+static_assert(lParser::COMPACT_CHUNK_CYLINDERS == 4096, "The vertex shaders of compact models divide by the chunk size");
+static_assert(sizeof(lParser::CompactChunk) == 3 * sizeof(glm::vec4), "Chunks are read as three texels");
+
+// Unit cylinder of the mesh placed between the ends of a line, one line for each instance.
+// The frame around the axis is the one of GEOMETRY_SHADER_C, so both draw the same cylinders.
+static const char* VERTEX_SHADER_MESH =
+	"#version 330 core\n"
+	"#extension GL_ARB_explicit_uniform_location : enable\n"
+	"layout(location = 7) in vec3 aMesh;\n"
+	"layout(location = 8) in vec4 aInit;\n"
+	"layout(location = 9) in vec4 aEnd;\n"
+	"layout(location = 0) uniform mat4 MVP;\n"
+	"layout(location = 2) uniform float widthScale;\n"
+	"out vec3 normal;\n"
+	"void main()\n"
+	"{\n"
+	"	vec3 axis = normalize(aEnd.xyz - aInit.xyz);\n"
+	"	vec3 perpx = cross(-axis, vec3(0.0, 0.0, 1.0));\n"
+	"	if (length(perpx) == 0.0) {\n"
+	"		perpx = cross(-axis, vec3(0.0, 1.0, 0.0));\n"
+	"	}\n"
+	"	vec3 perpy = cross(axis, perpx);\n"
+	"	normal = aMesh.x * perpx + aMesh.y * perpy;\n"
+	"	float r = widthScale * mix(aInit.w, aEnd.w, aMesh.z);\n"
+	"	vec3 p = mix(aInit.xyz, aEnd.xyz, aMesh.z) + r * normal;\n"
+	"	gl_Position = MVP * vec4(p, 1.0);\n"
+	"}\n";
+
 static const char* FRAGMENT_SHADER_C =
 	"#version 330 core\n"
 	"out vec4 FragColor;\n"
@@ -131,10 +243,21 @@ static const char* FRAGMENT_SHADER_C_COLOR =
 	"}\n";
 
 
-Renderer::Renderer() : mNumPrimitives(0)
+Renderer::Renderer()
 {
 	glGenVertexArrays(1, &mVAO);
 	glGenBuffers(1, &mVBO);
+	glGenBuffers(1, &mInstanceVBO);
+	glGenBuffers(1, &mEBO);
+	glGenVertexArrays(1, &mUploadVAO);
+	glGenBuffers(1, &mUploadVBO);
+	glGenBuffers(1, &mUploadEBO);
+	glGenBuffers(1, &mChunkBuffer);
+	glGenTextures(1, &mChunkTexture);
+	glGenBuffers(1, &mUploadChunkBuffer);
+	glGenTextures(1, &mUploadChunkTexture);
+	glGenBuffers(1, &mCylinderMeshVBO);
+	setRingSegments(DEFAULT_RING_SEGMENTS);
 
 	uint32_t vertexS = loadShader(VERTEX_SHADER, GL_VERTEX_SHADER);
 	uint32_t fragmentS = loadShader(FRAGMENT_SHADER, GL_FRAGMENT_SHADER);
@@ -142,86 +265,352 @@ Renderer::Renderer() : mNumPrimitives(0)
 	uint32_t geometryC = loadShader(GEOMETRY_SHADER_C, GL_GEOMETRY_SHADER);
 	uint32_t fragmentCN = loadShader(FRAGMENT_SHADER_C, GL_FRAGMENT_SHADER);
 	uint32_t fragmentC = loadShader(FRAGMENT_SHADER_C_COLOR, GL_FRAGMENT_SHADER);
+	uint32_t vertexCompact = loadShader(VERTEX_SHADER_COMPACT, GL_VERTEX_SHADER);
+	uint32_t vertexCompactC = loadShader(VERTEX_SHADER_COMPACT_C, GL_VERTEX_SHADER);
+	uint32_t vertexMesh = loadShader(VERTEX_SHADER_MESH, GL_VERTEX_SHADER);
 	CheckGLError();
-	{
-		mLineProgram = glCreateProgram();
-		glAttachShader(mLineProgram, vertexS);
-		glAttachShader(mLineProgram, fragmentS);
-
-		glLinkProgram(mLineProgram);
-		//there should not be linking errors....
-		int32_t success;
-		glGetProgramiv(mLineProgram, GL_LINK_STATUS, &success);
-		assert(success);
-	}
-	{
-		mCylinderProgram = glCreateProgram();
-		glAttachShader(mCylinderProgram, vertexC);
-		glAttachShader(mCylinderProgram, geometryC);
-		glAttachShader(mCylinderProgram, fragmentC);
-
-		glLinkProgram(mCylinderProgram);
-		//there should not be linking errors....
-		int32_t success;
-		glGetProgramiv(mCylinderProgram, GL_LINK_STATUS, &success);
-		assert(success);
-	}
-	{
-		mCylinderProgramNormal = glCreateProgram();
-		glAttachShader(mCylinderProgramNormal, vertexC);
-		glAttachShader(mCylinderProgramNormal, geometryC);
-		glAttachShader(mCylinderProgramNormal, fragmentCN);
-
-		glLinkProgram(mCylinderProgramNormal);
-		//there should not be linking errors....
-		int32_t success;
-		glGetProgramiv(mCylinderProgramNormal, GL_LINK_STATUS, &success);
-		assert(success);
-	}
+	mLineProgram = linkProgram(vertexS, 0, fragmentS);
+	mCylinderProgram = linkProgram(vertexC, geometryC, fragmentC);
+	mCylinderProgramNormal = linkProgram(vertexC, geometryC, fragmentCN);
+	mCompactLineProgram = linkProgram(vertexCompact, 0, fragmentS);
+	mCompactCylinderProgram = linkProgram(vertexCompactC, geometryC, fragmentC);
+	mCompactCylinderProgramNormal = linkProgram(vertexCompactC, geometryC, fragmentCN);
+	mMeshProgram = linkProgram(vertexMesh, 0, fragmentC);
+	mMeshProgramNormal = linkProgram(vertexMesh, 0, fragmentCN);
 	CheckGLError();
 	glDeleteShader(vertexS);
 	glDeleteShader(fragmentS);
 	glDeleteShader(vertexC);
 	glDeleteShader(fragmentC);
+	glDeleteShader(fragmentCN);
 	glDeleteShader(geometryC);
+	glDeleteShader(vertexCompact);
+	glDeleteShader(vertexCompactC);
+	glDeleteShader(vertexMesh);
 	CheckGLError();
 }
 
 Renderer::~Renderer()
 {
 	glDeleteProgram(mLineProgram);
+	glDeleteProgram(mCylinderProgram);
+	glDeleteProgram(mCylinderProgramNormal);
+	glDeleteProgram(mCompactLineProgram);
+	glDeleteProgram(mCompactCylinderProgram);
+	glDeleteProgram(mCompactCylinderProgramNormal);
+	glDeleteProgram(mMeshProgram);
+	glDeleteProgram(mMeshProgramNormal);
+	glDeleteBuffers(1, &mCylinderMeshVBO);
 
 	glDeleteVertexArrays(1, &mVAO);
 	glDeleteBuffers(1, &mVBO);
+	glDeleteBuffers(1, &mInstanceVBO);
+	glDeleteBuffers(1, &mEBO);
+	glDeleteVertexArrays(1, &mUploadVAO);
+	glDeleteBuffers(1, &mUploadVBO);
+	glDeleteBuffers(1, &mUploadEBO);
+	glDeleteBuffers(1, &mChunkBuffer);
+	glDeleteTextures(1, &mChunkTexture);
+	glDeleteBuffers(1, &mUploadChunkBuffer);
+	glDeleteTextures(1, &mUploadChunkTexture);
+	deleteSegments(&mSegments);
+	deleteSegments(&mUploadSegments);
 }
 
 void Renderer::setupPrimitivesToRender(const std::vector<lParser::Cylinder>& cylinders)
 {
-	glBindVertexArray(mVAO);
+	beginPrimitives(cylinders.size());
+	appendPrimitives(cylinders.data(), cylinders.size());
+	endPrimitives();
+}
 
-	glBindBuffer(GL_ARRAY_BUFFER, mVBO);
+void Renderer::setupPrimitivesToRender(const lParser::CylinderChunks& chunks)
+{
+	beginPrimitives(chunks.size());
+	for (size_t i = 0; i < chunks.chunkCount(); ++i) {
+		appendPrimitives(chunks.chunk(i), chunks.chunkSize(i));
+	}
+	endPrimitives();
+}
 
-	struct Data {
-		glm::vec3 pos;
-		float width;
-	};
-	std::vector<Data> vertData;
+void Renderer::setupInstancesToRender(const lParser::InstancedOut& model)
+{
+	if (model.nodes.empty()) {
+		setupPrimitivesToRender(std::vector<lParser::Cylinder>());
+		return;
+	}
+
+	// Walk the DAG from the root. The small nodes become instances, and the
+	// cylinders of the big ones are expanded into world space.
+	std::vector<std::vector<GpuInstance>> nodeInstances(model.nodes.size());
+	std::vector<lParser::Cylinder> cylinders;
+	std::vector<lParser::Instance> stack;
+	stack.push_back({ glm::quat(1.f, glm::vec3(0.f)), glm::vec3(0.f), 1.0f, model.root });
+	while (!stack.empty()) {
+		const lParser::Instance p = stack.back();
+		stack.pop_back();
+		const lParser::InstanceNode& node = model.nodes[p.node];
+		if (node.flatCylinders <= MAX_BAKED_CYLINDERS) {
+			nodeInstances[p.node].push_back({ glm::vec4(p.rotation.x, p.rotation.y, p.rotation.z, p.rotation.w),
+				glm::vec4(p.translation, p.widthScale) });
+			continue;
+		}
+		for (uint32_t i = node.firstCylinder; i < node.firstCylinder + node.cylinderCount; ++i) {
+			const lParser::Cylinder& c = model.cylinders[i];
+			cylinders.push_back({ p.translation + glm::rotate(p.rotation, c.init),
+				p.translation + glm::rotate(p.rotation, c.end),
+				p.widthScale * c.width });
+		}
+		for (uint32_t i = node.firstInstance; i < node.firstInstance + node.instanceCount; ++i) {
+			const lParser::Instance& instance = model.instances[i];
+			stack.push_back({ p.rotation * instance.rotation,
+				p.translation + glm::rotate(p.rotation, instance.translation),
+				p.widthScale * instance.widthScale,
+				instance.node });
+		}
+	}
+	std::vector<Batch> batches;
+	if (!cylinders.empty()) {
+		batches.push_back({ mUploadVAO, 0, 2 * (uint32_t)cylinders.size(), 0, 0, false, false });
+	}
+
+	// Then the geometry of each instanced node, once
+	std::vector<GpuInstance> instances;
+	for (uint32_t n = 0; n < (uint32_t)model.nodes.size(); ++n) {
+		if (nodeInstances[n].empty()) {
+			continue;
+		}
+		const uint32_t first = (uint32_t)cylinders.size();
+		lParser::flatten(model, n, &cylinders);
+		batches.push_back({ mUploadVAO, 2 * first, 2 * ((uint32_t)cylinders.size() - first),
+			(uint32_t)instances.size(), (uint32_t)nodeInstances[n].size(), false, false });
+		instances.insert(instances.end(), nodeInstances[n].begin(), nodeInstances[n].end());
+	}
+
+	// In a single buffer, the batches are ranges of it
+	std::vector<VertexData> vertData;
 	vertData.reserve(2 * cylinders.size());
 	for (const lParser::Cylinder& c : cylinders) {
-		vertData.push_back(Data{ c.init, c.width });
-		vertData.push_back(Data{ c.end, c.width });
+		vertData.push_back(VertexData{ c.init, c.width });
+		vertData.push_back(VertexData{ c.end, c.width });
+	}
+	discardPrimitives();
+	glBindBuffer(GL_ARRAY_BUFFER, mUploadVBO);
+	glBufferData(GL_ARRAY_BUFFER, vertData.size() * sizeof(VertexData), vertData.data(), GL_STATIC_DRAW);
+	setVertexAttributes(mUploadVAO, mUploadVBO);
+	mUploadBatches = batches;
+	endPrimitives();
+	mGpuBytes = vertData.size() * sizeof(VertexData);
+	glBindBuffer(GL_ARRAY_BUFFER, mInstanceVBO);
+	glBufferData(GL_ARRAY_BUFFER,
+		instances.size() * sizeof(GpuInstance),
+		instances.data(),
+		GL_STATIC_DRAW);
+	mGpuBytes += instances.size() * sizeof(GpuInstance);
+	CheckGLError();
+}
+
+void Renderer::setupSkeletonToRender(const lParser::SkeletonOut& skeleton)
+{
+	std::vector<VertexData> vertData;
+	vertData.reserve(skeleton.nodes.size());
+	for (const lParser::SkeletonNode& node : skeleton.nodes) {
+		vertData.push_back(VertexData{ node.position, node.width });
+	}
+	// Segment i goes from its parent to node i + 1
+	std::vector<uint32_t> indices;
+	indices.reserve(2 * skeleton.segmentCount());
+	for (size_t i = 0; i < skeleton.segmentCount(); ++i) {
+		indices.push_back(skeleton.parents[i]);
+		indices.push_back((uint32_t)i + 1);
+	}
+	discardPrimitives();
+	glBindBuffer(GL_ARRAY_BUFFER, mUploadVBO);
+	glBufferData(GL_ARRAY_BUFFER, vertData.size() * sizeof(VertexData), vertData.data(), GL_STATIC_DRAW);
+	setVertexAttributes(mUploadVAO, mUploadVBO);
+	// The element buffer is part of the state of the vertex array
+	glBindVertexArray(mUploadVAO);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mUploadEBO);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
+	glBindVertexArray(0);
+	CheckGLError();
+	if (!indices.empty()) {
+		mUploadBatches.push_back({ mUploadVAO, 0, (uint32_t)indices.size(), 0, 0, true, false });
+	}
+	endPrimitives();
+	mGpuBytes = vertData.size() * sizeof(VertexData) + indices.size() * sizeof(uint32_t);
+}
+
+void Renderer::setupCompactToRender(const lParser::CompactCylinders& model)
+{
+	discardPrimitives();
+	glBindBuffer(GL_ARRAY_BUFFER, mUploadVBO);
+	glBufferData(GL_ARRAY_BUFFER, model.cylinders.size() * sizeof(lParser::CompactCylinder),
+		model.cylinders.data(), GL_STATIC_DRAW);
+	// One cylinder for each instance, the two vertices of its line are told apart by gl_VertexID
+	glBindVertexArray(mUploadVAO);
+	glDisableVertexAttribArray(0);
+	glDisableVertexAttribArray(1);
+	const GLsizei stride = sizeof(lParser::CompactCylinder);
+	glVertexAttribIPointer(4, 4, GL_UNSIGNED_SHORT, stride, (void*)offsetof(lParser::CompactCylinder, position));
+	glVertexAttribIPointer(5, 2, GL_SHORT, stride, (void*)offsetof(lParser::CompactCylinder, direction));
+	glVertexAttribIPointer(6, 1, GL_UNSIGNED_BYTE, stride, (void*)offsetof(lParser::CompactCylinder, width));
+	for (uint32_t attribute = 4; attribute <= 6; ++attribute) {
+		glEnableVertexAttribArray(attribute);
+		glVertexAttribDivisor(attribute, 1);
+	}
+	glBindVertexArray(0);
+
+	glBindBuffer(GL_TEXTURE_BUFFER, mUploadChunkBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, model.chunks.size() * sizeof(lParser::CompactChunk),
+		model.chunks.data(), GL_STATIC_DRAW);
+	glBindTexture(GL_TEXTURE_BUFFER, mUploadChunkTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, mUploadChunkBuffer);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	CheckGLError();
+	if (!model.cylinders.empty()) {
+		mUploadBatches.push_back({ mUploadVAO, 0, 2, 0, (uint32_t)model.cylinders.size(), false, true });
 	}
-	mNumPrimitives = (uint32_t)vertData.size();
+	endPrimitives();
+	mGpuBytes = model.bytes();
+}
+
+void Renderer::beginPrimitives(uint64_t maxCylinders)
+{
+	discardPrimitives();
+	mSegmentCapacity = std::max<uint64_t>(std::min(maxCylinders, GPU_SEGMENT_CYLINDERS), 1);
+	glBindBuffer(GL_ARRAY_BUFFER, mUploadVBO);
 	glBufferData(GL_ARRAY_BUFFER,
-		vertData.size() * sizeof(Data),
-		vertData.data(),
+		2 * mSegmentCapacity * sizeof(VertexData),
+		nullptr,
 		GL_STATIC_DRAW);
 	CheckGLError();
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Data), (void*)offsetof(Data, pos));
-	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(Data), (void*)offsetof(Data, width));
+	setVertexAttributes(mUploadVAO, mUploadVBO);
+	mUploadBytes = 2 * mSegmentCapacity * sizeof(VertexData);
+}
+
+void Renderer::appendPrimitives(const lParser::Cylinder* cylinders, size_t count)
+{
+	while (count > 0) {
+		// A full buffer is kept as it is, the next cylinders go to a new one
+		if (mSegmentCylinders == mSegmentCapacity) {
+			Segment segment;
+			glGenVertexArrays(1, &segment.vao);
+			glGenBuffers(1, &segment.vbo);
+			glBindBuffer(GL_ARRAY_BUFFER, segment.vbo);
+			glBufferData(GL_ARRAY_BUFFER, 2 * GPU_SEGMENT_CYLINDERS * sizeof(VertexData), nullptr, GL_STATIC_DRAW);
+			CheckGLError();
+			setVertexAttributes(segment.vao, segment.vbo);
+			mUploadSegments.push_back(segment);
+			mSegmentCylinders = 0;
+			mSegmentCapacity = GPU_SEGMENT_CYLINDERS;
+			mUploadBytes += 2 * GPU_SEGMENT_CYLINDERS * sizeof(VertexData);
+		}
+		const Segment segment = mUploadSegments.empty() ? Segment{ mUploadVAO, mUploadVBO } : mUploadSegments.back();
+		const size_t n = (size_t)std::min<uint64_t>(count, mSegmentCapacity - mSegmentCylinders);
+
+		mVertices.clear();
+		for (size_t i = 0; i < n; ++i) {
+			mVertices.push_back(glm::vec4(cylinders[i].init, cylinders[i].width));
+			mVertices.push_back(glm::vec4(cylinders[i].end, cylinders[i].width));
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, segment.vbo);
+		glBufferSubData(GL_ARRAY_BUFFER,
+			2 * mSegmentCylinders * sizeof(VertexData),
+			mVertices.size() * sizeof(VertexData),
+			mVertices.data());
+		CheckGLError();
+		if (mSegmentCylinders == 0) {
+			mUploadBatches.push_back({ segment.vao, 0, 0, 0, 0, false, false });
+		}
+		mSegmentCylinders += n;
+		mUploadBatches.back().vertexCount = 2 * (uint32_t)mSegmentCylinders;
+		cylinders += n;
+		count -= n;
+	}
+}
+
+void Renderer::endPrimitives()
+{
+	// The uploaded buffer becomes the model, and the old one is reused by the next upload
+	std::swap(mVAO, mUploadVAO);
+	std::swap(mVBO, mUploadVBO);
+	std::swap(mEBO, mUploadEBO);
+	std::swap(mChunkBuffer, mUploadChunkBuffer);
+	std::swap(mChunkTexture, mUploadChunkTexture);
+	mBatches.swap(mUploadBatches);
+	mSegments.swap(mUploadSegments);
+	mGpuBytes = mUploadBytes;
+	discardPrimitives();
+}
+
+void Renderer::discardPrimitives()
+{
+	glBindBuffer(GL_ARRAY_BUFFER, mUploadVBO);
+	glBufferData(GL_ARRAY_BUFFER, 0, nullptr, GL_STATIC_DRAW);
+	glBindVertexArray(mUploadVAO);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mUploadEBO);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, 0, nullptr, GL_STATIC_DRAW);
+	glBindVertexArray(0);
+	glBindBuffer(GL_TEXTURE_BUFFER, mUploadChunkBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, 0, nullptr, GL_STATIC_DRAW);
+	CheckGLError();
+	deleteSegments(&mUploadSegments);
+	mUploadBatches.clear();
+	mSegmentCylinders = 0;
+	mSegmentCapacity = 0;
+	mUploadBytes = 0;
+}
+
+void Renderer::deleteSegments(std::vector<Segment>* segments)
+{
+	for (const Segment& segment : *segments) {
+		glDeleteVertexArrays(1, &segment.vao);
+		glDeleteBuffers(1, &segment.vbo);
+	}
+	segments->clear();
+}
+
+void Renderer::setRingSegments(uint32_t segments)
+{
+	mRingSegments = segments < MIN_RING_SEGMENTS ? MIN_RING_SEGMENTS :
+		segments > MAX_RING_SEGMENTS ? MAX_RING_SEGMENTS : segments;
+	std::vector<glm::vec3> mesh;
+	mesh.reserve(2 * (mRingSegments + 1));
+	for (uint32_t i = 0; i <= mRingSegments; ++i) {
+		const float a = i / (float)mRingSegments * 2.0f * 3.14159f;
+		mesh.push_back(glm::vec3(std::cos(a), std::sin(a), 0.0f));
+		mesh.push_back(glm::vec3(std::cos(a), std::sin(a), 1.0f));
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, mCylinderMeshVBO);
+	glBufferData(GL_ARRAY_BUFFER, mesh.size() * sizeof(glm::vec3), mesh.data(), GL_STATIC_DRAW);
+	CheckGLError();
+}
+
+void Renderer::setVertexAttributes(uint32_t vao, uint32_t vbo) const
+{
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, pos));
+	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, width));
 
 	glEnableVertexAttribArray(0);
 	glEnableVertexAttribArray(1);
+	glVertexAttribDivisor(2, 1);
+	glVertexAttribDivisor(3, 1);
+	// The vertex array may have been used by a compact model
+	glDisableVertexAttribArray(4);
+	glDisableVertexAttribArray(5);
+	glDisableVertexAttribArray(6);
+	// The mesh, and the two vertices of each line as attributes of an instance. They are
+	// only enabled while drawing the mesh.
+	glBindBuffer(GL_ARRAY_BUFFER, mCylinderMeshVBO);
+	glVertexAttribPointer(7, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glVertexAttribPointer(8, 4, GL_FLOAT, GL_FALSE, 2 * sizeof(VertexData), (void*)0);
+	glVertexAttribPointer(9, 4, GL_FLOAT, GL_FALSE, 2 * sizeof(VertexData), (void*)sizeof(VertexData));
+	glVertexAttribDivisor(8, 1);
+	glVertexAttribDivisor(9, 1);
 
 	glBindVertexArray(0);
 	CheckGLError();
@@ -229,41 +618,135 @@ void Renderer::setupPrimitivesToRender(const std::vector<lParser::Cylinder>& cyl
 
 void Renderer::render(const glm::mat4& projView, uint32_t mode) const
 {
-	if (mNumPrimitives == 0) {
+	// A model that is being uploaded is rendered as soon as it has some cylinders
+	const bool uploading = !mUploadBatches.empty();
+	const std::vector<Batch>& batches = uploading ? mUploadBatches : mBatches;
+	if (batches.empty()) {
 		return;
 	}
 
-	if (mode == 0) {
-		glUseProgram(mLineProgram);
+	// A model is either compact or not, the compact ones are decoded by other vertex shaders
+	const bool compact = batches.front().compact;
+	const bool mesh = mode == 3 || mode == 4;
+	const uint32_t shading = mode == 0 ? 0 : mode == 1 || mode == 3 ? 1 : 2;
+	uint32_t shaderProgram;
+	if (shading == 0) {
+		shaderProgram = compact ? mCompactLineProgram : mLineProgram;
 		glLineWidth(2);
-		glUniform3f(1, mColor.x, mColor.y, mColor.z);
-		CheckGLError();
 	}
-	else if(mode == 1) {
-		glUseProgram(mCylinderProgram);
-		CheckGLError();
-		glUniform3f(1, mColor.x, mColor.y, mColor.z);
-		glUniform1f(2, mCylinderWidthMultiplier);
-		CheckGLError();
+	else if (shading == 1) {
+		shaderProgram = compact ? mCompactCylinderProgram : mCylinderProgram;
 	}
 	else {
-		glUseProgram(mCylinderProgramNormal);
-		CheckGLError();
-		glUniform1f(2, mCylinderWidthMultiplier);
-		CheckGLError();
+		shaderProgram = compact ? mCompactCylinderProgramNormal : mCylinderProgramNormal;
+	}
+	const uint32_t meshProgram = shading == 1 ? mMeshProgram : mMeshProgramNormal;
+	if (compact) {
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_BUFFER, uploading ? mUploadChunkTexture : mChunkTexture);
 	}
 
-	glUniformMatrix4fv(0, 1, GL_FALSE, &projView[0][0]);
-
+	// The batches of a streamed model are in several vertex arrays
+	uint32_t vao = 0;
+	uint32_t program = 0;
+	for (const Batch& batch : batches) {
+		if (batch.vao != vao) {
+			vao = batch.vao;
+			glBindVertexArray(vao);
+		}
+		// Lines of the vertex buffer, drawn as they are, can be instances of the mesh
+		const bool meshed = mesh && !batch.compact && !batch.indexed && batch.instanceCount == 0 && batch.firstVertex == 0;
+		if ((meshed ? meshProgram : shaderProgram) != program) {
+			program = meshed ? meshProgram : shaderProgram;
+			useProgram(program, shading, projView);
+			if (compact) {
+				glUniform1i(3, 0);
+			}
+		}
+		if (meshed) {
+			glEnableVertexAttribArray(7);
+			glEnableVertexAttribArray(8);
+			glEnableVertexAttribArray(9);
+			glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 2 * (mRingSegments + 1), batch.vertexCount / 2);
+			glDisableVertexAttribArray(7);
+			glDisableVertexAttribArray(8);
+			glDisableVertexAttribArray(9);
+			continue;
+		}
+		if (batch.compact) {
+			glDrawArraysInstanced(GL_LINES, 0, 2, batch.instanceCount);
+			continue;
+		}
+		if (batch.instanceCount == 0) {
+			// Identity transform, from the current values of the disabled attributes
+			glDisableVertexAttribArray(2);
+			glDisableVertexAttribArray(3);
+			glVertexAttrib4f(2, 0.f, 0.f, 0.f, 1.f);
+			glVertexAttrib4f(3, 0.f, 0.f, 0.f, 1.f);
+			if (batch.indexed) {
+				glDrawElements(GL_LINES, batch.vertexCount, GL_UNSIGNED_INT,
+					(void*)(batch.firstVertex * sizeof(uint32_t)));
+			}
+			else {
+				glDrawArrays(GL_LINES, batch.firstVertex, batch.vertexCount);
+			}
+			continue;
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, mInstanceVBO);
+		const size_t offset = batch.firstInstance * sizeof(GpuInstance);
+		glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(GpuInstance), (void*)(offset + offsetof(GpuInstance, rotation)));
+		glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(GpuInstance), (void*)(offset + offsetof(GpuInstance, translation)));
+		glEnableVertexAttribArray(2);
+		glEnableVertexAttribArray(3);
+		glDrawArraysInstanced(GL_LINES, batch.firstVertex, batch.vertexCount, batch.instanceCount);
+	}
 	CheckGLError();
 
+	glBindVertexArray(0);
+}
 
-	glBindVertexArray(mVAO);
-
-	glDrawArrays(GL_LINES, 0, mNumPrimitives);
+void Renderer::useProgram(uint32_t program, uint32_t shading, const glm::mat4& projView) const
+{
+	glUseProgram(program);
+	CheckGLError();
+	if (shading != 2) {
+		glUniform3f(1, mColor.x, mColor.y, mColor.z);
+	}
+	if (shading != 0) {
+		glUniform1f(2, mCylinderWidthMultiplier);
+	}
+	glUniformMatrix4fv(0, 1, GL_FALSE, &projView[0][0]);
 	CheckGLError();
+}
 
-	glBindVertexArray(0);
+double Renderer::timeRender(const glm::mat4& projView, uint32_t mode, uint32_t times) const
+{
+	glFinish();
+	const auto start = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i < times; ++i) {
+		glClear(GL_DEPTH_BUFFER_BIT);
+		render(projView, mode);
+	}
+	glFinish();
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return 1000.0 * seconds / std::max(times, 1u);
+}
+
+uint32_t Renderer::linkProgram(uint32_t vertex, uint32_t geometry, uint32_t fragment)
+{
+	uint32_t program = glCreateProgram();
+	glAttachShader(program, vertex);
+	if (geometry != 0) {
+		glAttachShader(program, geometry);
+	}
+	glAttachShader(program, fragment);
+
+	glLinkProgram(program);
+	//there should not be linking errors....
+	int32_t success;
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	assert(success);
+	return program;
 }
 
 uint32_t Renderer::loadShader(const char* c_str, uint32_t shaderType)
@@ -288,3 +771,21 @@ uint32_t Renderer::loadShader(const char* c_str, uint32_t shaderType)
 	CheckGLError();
 	return shader;
 }
+
+bool RendererSink::begin(uint64_t cylinders, std::string* /*outErr*/)
+{
+	mRenderer->beginPrimitives(cylinders);
+	return true;
+}
+
+bool RendererSink::consume(const lParser::Cylinder* cylinders, size_t count, std::string* /*outErr*/)
+{
+	mRenderer->appendPrimitives(cylinders, count);
+	return true;
+}
+
+bool RendererSink::finish(std::string* /*outErr*/)
+{
+	mRenderer->endPrimitives();
+	return true;
+}
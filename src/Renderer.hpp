@@ -4,6 +4,10 @@
 #include <cstdint>
 #include <glm/glm.hpp>
 #include "lParser.hpp"
+#include "lInstanced.hpp"
+#include "lSkeleton.hpp"
+#include "lSink.hpp"
+#include "lCompact.hpp"
 
 class Renderer {
 public:
@@ -12,6 +16,30 @@ public:
 
 	// Send to the GPU the cylinders to render
 	void setupPrimitivesToRender(const std::vector<lParser::Cylinder>& cylinders);
+	// Same, block by block
+	void setupPrimitivesToRender(const lParser::CylinderChunks& chunks);
+	// Send to the GPU a model made of instances. Each node with up to MAX_BAKED_CYLINDERS
+	// is uploaded once and drawn instanced, the bigger ones are expanded.
+	void setupInstancesToRender(const lParser::InstancedOut& model);
+	// Send to the GPU a skeleton. Its nodes are uploaded once, and the segments are
+	// drawn as lines of indices, so the widths taper between the nodes.
+	void setupSkeletonToRender(const lParser::SkeletonOut& skeleton);
+	// Send to the GPU a quantized model, as it is. The vertex shader decodes it: each
+	// cylinder is an instance of a line, and the chunks are read from a buffer texture.
+	void setupCompactToRender(const lParser::CompactCylinders& model);
+	// Send the cylinders to the GPU in batches, while they are generated.
+	// maxCylinders is a hint of the size of the first buffer. When it is full, the next
+	// cylinders go to new buffers of GPU_SEGMENT_CYLINDERS, so nothing is copied again.
+	// The last model is rendered until the first batch arrives, then the new one
+	// is rendered while it fills in. endPrimitives replaces the last model, and
+	// discardPrimitives drops the new one, rendering again the last model.
+	void beginPrimitives(uint64_t maxCylinders);
+	void appendPrimitives(const lParser::Cylinder* cylinders, size_t count);
+	void endPrimitives();
+	void discardPrimitives();
+	// Draw calls and bytes of the model in the GPU
+	uint32_t getBatchCount() const { return (uint32_t)mBatches.size(); }
+	size_t getGpuBytes() const { return mGpuBytes; }
 	// Update the scale of the cylinders
 	void setCylinderScale(float scale) { mCylinderWidthMultiplier = scale; }
 	// Update the color of the plant
@@ -19,16 +47,90 @@ public:
 	// mode 0 = line
 	// mode 1 = cylinders
 	// mode 2 = cylinders shaded witht the normal
+	// mode 3 = cylinders drawn as instances of a mesh, without geometry shader
+	// mode 4 = same, shaded with the normal
+	// The mesh is only used by the plain cylinders, the instanced, skeleton and compact
+	// models are drawn as in modes 1 and 2.
 	void render(const glm::mat4& projView, uint32_t mode) const;
+	// Render the model some times, clearing the depth before each one, and return the
+	// milliseconds of each time. Waits for the GPU before and after.
+	double timeRender(const glm::mat4& projView, uint32_t mode, uint32_t times) const;
+	// Sides of the mesh of modes 3 and 4, clamped to [MIN_RING_SEGMENTS, MAX_RING_SEGMENTS]
+	void setRingSegments(uint32_t segments);
+	uint32_t getRingSegments() const { return mRingSegments; }
+
+	static const uint64_t MAX_BAKED_CYLINDERS = 1 << 16;
+	// Cylinders of each buffer of a streaming upload, the first one can be smaller
+	static const uint64_t GPU_SEGMENT_CYLINDERS = 1 << 22;
+	static const uint32_t MIN_RING_SEGMENTS = 3;
+	static const uint32_t MAX_RING_SEGMENTS = 64;
+	// The geometry shader closes 15 sides with 16 vertices
+	static const uint32_t DEFAULT_RING_SEGMENTS = 15;
 
 private:
+	// Range of vertices of a vertex array drawn with a range of instances. Without
+	// instances the vertices are drawn once, as they are. Indexed batches draw a range
+	// of the element buffer instead, and compact batches draw a line for each instance.
+	struct Batch {
+		uint32_t vao;
+		uint32_t firstVertex, vertexCount;
+		uint32_t firstInstance, instanceCount;
+		bool indexed;
+		bool compact;
+	};
+	// Buffer of a fixed size of a streamed model, with its vertex array
+	struct Segment {
+		uint32_t vao, vbo;
+	};
+
 	uint32_t mVAO;
 	uint32_t mVBO;
-	uint32_t mNumPrimitives;
+	uint32_t mInstanceVBO;
+	uint32_t mEBO;
+	uint32_t mChunkBuffer, mChunkTexture; // chunks of a compact model
+	std::vector<Batch> mBatches;
+	std::vector<Segment> mSegments;  // after the first buffer
+	size_t mGpuBytes = 0;
+	// Streaming upload, into its own buffer until it ends
+	uint32_t mUploadVAO;
+	uint32_t mUploadVBO;
+	uint32_t mUploadEBO;
+	uint32_t mUploadChunkBuffer, mUploadChunkTexture;
+	std::vector<Batch> mUploadBatches;
+	std::vector<Segment> mUploadSegments;
+	uint64_t mSegmentCylinders = 0, mSegmentCapacity = 0; // of the buffer being filled
+	size_t mUploadBytes = 0;
+	std::vector<glm::vec4> mVertices; // of the last batch, reused by the next ones
 
 	float mCylinderWidthMultiplier = 1.0f;
 	glm::vec3 mColor = glm::vec3(0.1f, 0.9f, 0.2f);
 	uint32_t mLineProgram, mCylinderProgram, mCylinderProgramNormal;
+	uint32_t mCompactLineProgram, mCompactCylinderProgram, mCompactCylinderProgramNormal;
+	uint32_t mMeshProgram, mMeshProgramNormal;
+	// Ring of a unit cylinder as a triangle strip, the cosine and sine of the angle of each
+	// vertex, and 0 at the start or 1 at the end
+	uint32_t mCylinderMeshVBO;
+	uint32_t mRingSegments = DEFAULT_RING_SEGMENTS;
 
 	static uint32_t loadShader(const char* shader, uint32_t shaderType);
+	// The geometry shader can be 0
+	static uint32_t linkProgram(uint32_t vertex, uint32_t geometry, uint32_t fragment);
+	// Set the uniforms of a program of the modes 0 (lines), 1 (color) or 2 (normal)
+	void useProgram(uint32_t program, uint32_t shading, const glm::mat4& projView) const;
+	void setVertexAttributes(uint32_t vao, uint32_t vbo) const;
+	static void deleteSegments(std::vector<Segment>* segments);
+};
+
+// Sink that uploads the cylinders to a renderer while they are generated.
+// It has to be used in the thread of the OpenGL context.
+class RendererSink : public lParser::CylinderSink {
+public:
+	explicit RendererSink(Renderer* renderer) : mRenderer(renderer) {}
+
+	bool begin(uint64_t cylinders, std::string* outErr) override;
+	bool consume(const lParser::Cylinder* cylinders, size_t count, std::string* outErr) override;
+	bool finish(std::string* outErr) override;
+
+private:
+	Renderer* mRenderer;
 };
\ No newline at end of file
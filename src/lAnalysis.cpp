@@ -0,0 +1,365 @@
+#include "lAnalysis.hpp"
+#include "lGrammar.hpp"
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <chrono>
+
+using namespace lParser;
+
+static const uint64_t SATURATED = std::numeric_limits<uint64_t>::max();
+// Iterations of the power method, the eigenvalue is measured over the second half
+static const uint32_t POWER_ITERATIONS = 256;
+// Ops counted by the estimation between two checks of the cancel flag and the time limit
+static const uint64_t ESTIMATE_CHECK_OPS = 1 << 20;
+
+uint64_t saturatedAdd(uint64_t a, uint64_t b) {
+    return a > SATURATED - b ? SATURATED : a + b;
+}
+
+// Counts of the expansion of a symbol, or of a range of ops
+struct Counts {
+    uint64_t cylinders = 0, symbols = 0;
+    double expectedCylinders = 0.0, expectedSymbols = 0.0;
+    int64_t stackDelta = 0;  // pushed minus popped turtles at the end
+    int64_t maxStack = 0;    // highest number of pushed turtles, relative to the start
+
+    bool operator==(const Counts& o) const {
+        return cylinders == o.cylinders && symbols == o.symbols && stackDelta == o.stackDelta &&
+            maxStack == o.maxStack && expectedCylinders == o.expectedCylinders &&
+            expectedSymbols == o.expectedSymbols;
+    }
+};
+
+// Count a range of ops, whose rewritten symbols have the counts of children.
+// If children is null, no symbol is rewritten.
+Counts countRange(const Grammar& grammar, uint32_t begin, uint32_t end, const std::vector<Counts>* children) {
+    Counts c;
+    for (uint32_t i = begin; i < end; ++i) {
+        const Op& op = grammar.ops[i];
+        c.symbols = saturatedAdd(c.symbols, 1);
+        c.expectedSymbols += 1.0;
+        if (op.code == OpCode::Forward) {
+            c.cylinders = saturatedAdd(c.cylinders, 1);
+            c.expectedCylinders += 1.0;
+        }
+        else if (op.code == OpCode::Push) {
+            c.stackDelta += 1;
+            c.maxStack = std::max(c.maxStack, c.stackDelta);
+        }
+        else if (op.code == OpCode::Pop) {
+            c.stackDelta -= 1;
+        }
+
+        const SymbolEntry& entry = grammar.symbols[(uint8_t)op.symbol];
+        if (children != nullptr && entry.count != 0) {
+            const Counts& child = (*children)[(uint8_t)op.symbol];
+            c.symbols = saturatedAdd(c.symbols, child.symbols);
+            c.cylinders = saturatedAdd(c.cylinders, child.cylinders);
+            c.expectedSymbols += child.expectedSymbols;
+            c.expectedCylinders += child.expectedCylinders;
+            c.maxStack = std::max(c.maxStack, c.stackDelta + child.maxStack);
+            c.stackDelta += child.stackDelta;
+        }
+    }
+    return c;
+}
+
+uint64_t ParseEstimate::reservedCylinders() const
+{
+    if (exact) {
+        return cylinders;
+    }
+    const double expected = std::ceil(expectedCylinders * RESERVE_HEADROOM);
+    return expected < (double)cylinders ? (uint64_t)expected : cylinders;
+}
+
+uint64_t ParseEstimate::reservedSymbols() const
+{
+    if (exact) {
+        return symbols;
+    }
+    const double expected = std::ceil(expectedSymbols * RESERVE_HEADROOM);
+    return expected < (double)symbols ? (uint64_t)expected : symbols;
+}
+
+// Change of the counts of a symbol from one level to the next
+struct Growth {
+    uint64_t cylinders = 0, symbols = 0;
+    int64_t stackDelta = 0, maxStack = 0;
+
+    Growth() = default;
+    Growth(const Counts& next, const Counts& last) : cylinders(next.cylinders - last.cylinders),
+        symbols(next.symbols - last.symbols), stackDelta(next.stackDelta - last.stackDelta),
+        maxStack(next.maxStack - last.maxStack) {}
+
+    bool operator==(const Growth& o) const {
+        return cylinders == o.cylinders && symbols == o.symbols && stackDelta == o.stackDelta &&
+            maxStack == o.maxStack;
+    }
+};
+
+uint64_t saturatedExtrapolate(uint64_t value, uint64_t step, uint64_t levels) {
+    return step != 0 && levels > (SATURATED - value) / step ? SATURATED : value + step * levels;
+}
+
+int64_t clampedExtrapolate(int64_t value, int64_t step, uint64_t levels) {
+    const double extrapolated = (double)value + (double)step * (double)levels;
+    return (int64_t)std::max(std::min(extrapolated, 9e18), -9e18);
+}
+
+// Counts of the model when it does not fit in 64 bits
+void saturateEstimate(ParseEstimate* out) {
+    out->cylinders = SATURATED;
+    out->symbols = SATURATED;
+    out->maxStackDepth = std::numeric_limits<uint32_t>::max();
+    out->expectedCylinders = std::numeric_limits<double>::infinity();
+    out->expectedSymbols = std::numeric_limits<double>::infinity();
+    out->exact = false;
+}
+
+bool lParser::estimate(const Grammar& grammar, ParseEstimate* out, const ParseLimits& limits)
+{
+    assert(out != nullptr);
+    *out = ParseEstimate();
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // Counts of each symbol when it is rewritten with some remaining depth.
+    // Only the previous depth is needed to compute the next one.
+    std::vector<Counts> previous(256), current(256);
+    std::vector<Growth> growths(256);
+    std::vector<uint32_t> ruleSymbols;
+    bool stochastic = false;
+    uint64_t levelOps = 0; // ops counted at each level
+    for (uint32_t s = 0; s < 256; ++s) {
+        const SymbolEntry& entry = grammar.symbols[s];
+        if (entry.count != 0) {
+            ruleSymbols.push_back(s);
+            stochastic |= entry.count > 1;
+            for (uint32_t j = 0; j < entry.count; ++j) {
+                levelOps += grammar.successors[entry.first + j].end - grammar.successors[entry.first + j].begin;
+            }
+        }
+    }
+
+    bool hasPrevious = false, hasGrowth = false;
+    Counts lastAxiom;
+    uint64_t ops = 0, nextCheck = 0;
+    for (uint32_t remaining = 0; remaining < grammar.maxRecursionLevel; ++remaining) {
+        // Only huge recursion levels take long, and they can be stopped
+        if (ops >= nextCheck) {
+            nextCheck = ops + ESTIMATE_CHECK_OPS;
+            if ((limits.cancel != nullptr && limits.cancel->load(std::memory_order_relaxed)) ||
+                (limits.maxSeconds > 0.0 &&
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() > limits.maxSeconds)) {
+                saturateEstimate(out);
+                return false;
+            }
+        }
+        ops += levelOps;
+
+        for (uint32_t s : ruleSymbols) {
+            const SymbolEntry& entry = grammar.symbols[s];
+            Counts& counts = current[s];
+            counts = Counts();
+            float accumulated = 0.0f;
+            for (uint32_t j = 0; j < entry.count; ++j) {
+                const Successor& successor = grammar.successors[entry.first + j];
+                const Counts c = countRange(grammar, successor.begin, successor.end, hasPrevious ? &previous : nullptr);
+                // The last successor takes all the remaining probability
+                const double p = j + 1 == entry.count ? 1.0 - accumulated : successor.probability - accumulated;
+                accumulated = successor.probability;
+
+                counts.cylinders = std::max(counts.cylinders, c.cylinders);
+                counts.symbols = std::max(counts.symbols, c.symbols);
+                counts.stackDelta = j == 0 ? c.stackDelta : std::max(counts.stackDelta, c.stackDelta);
+                counts.maxStack = std::max(counts.maxStack, c.maxStack);
+                counts.expectedCylinders += p * c.expectedCylinders;
+                counts.expectedSymbols += p * c.expectedSymbols;
+            }
+        }
+        // Once the counts stop changing, deeper levels are equal
+        bool fixedPoint = hasPrevious;
+        for (uint32_t s : ruleSymbols) {
+            fixedPoint = fixedPoint && previous[s] == current[s];
+        }
+        previous.swap(current);
+        const bool hadPrevious = hasPrevious;
+        hasPrevious = true;
+        if (fixedPoint) {
+            break;
+        }
+        // Once the ones of the axiom do not fit, the model is too big to be generated anyway
+        const Counts axiom = countRange(grammar, grammar.axiomBegin, grammar.axiomEnd, &previous);
+        if (axiom.symbols == SATURATED) {
+            saturateEstimate(out);
+            return true;
+        }
+        if (stochastic) {
+            continue;
+        }
+        // A deterministic derivation that did not grow in the last level has no symbols
+        // at that depth, so it has ended, even if symbols that it does not reach keep growing
+        if (hadPrevious && axiom == lastAxiom) {
+            break;
+        }
+        lastAxiom = axiom;
+        // The growth of the counts of the next level is a linear function of the growth of
+        // this one, so once it repeats, it is the same at every deeper level and the counts
+        // of the last level are extrapolated. The stack depth is a maximum, not linear, but
+        // it is only used to reserve memory.
+        if (hadPrevious) {
+            bool linear = hasGrowth;
+            for (uint32_t s : ruleSymbols) {
+                const Growth growth(previous[s], current[s]);
+                linear = linear && growth == growths[s];
+                growths[s] = growth;
+            }
+            hasGrowth = true;
+            if (linear) {
+                const uint64_t levels = grammar.maxRecursionLevel - 1 - remaining;
+                for (uint32_t s : ruleSymbols) {
+                    Counts& counts = previous[s];
+                    counts.cylinders = saturatedExtrapolate(counts.cylinders, growths[s].cylinders, levels);
+                    counts.symbols = saturatedExtrapolate(counts.symbols, growths[s].symbols, levels);
+                    counts.stackDelta = clampedExtrapolate(counts.stackDelta, growths[s].stackDelta, levels);
+                    counts.maxStack = clampedExtrapolate(counts.maxStack, growths[s].maxStack, levels);
+                    counts.expectedCylinders = (double)counts.cylinders;
+                    counts.expectedSymbols = (double)counts.symbols;
+                }
+                break;
+            }
+        }
+    }
+
+    const Counts c = countRange(grammar, grammar.axiomBegin, grammar.axiomEnd, hasPrevious ? &previous : nullptr);
+    if (c.symbols == SATURATED) {
+        saturateEstimate(out);
+        return true;
+    }
+    out->cylinders = c.cylinders;
+    out->symbols = c.symbols;
+    out->maxStackDepth = (uint32_t)std::max<int64_t>(std::min<int64_t>(c.maxStack, std::numeric_limits<uint32_t>::max()), 0);
+    out->expectedCylinders = c.expectedCylinders;
+    out->expectedSymbols = c.expectedSymbols;
+    out->exact = !stochastic;
+    return true;
+}
+
+void lParser::analyzeGrowth(const Grammar& grammar, uint32_t maxDepth, double nsPerSymbol, GrowthAnalysis* out)
+{
+    assert(out != nullptr);
+    *out = GrowthAnalysis();
+
+    const uint32_t n = grammar.ruleSymbolCount;
+    out->symbols.resize(n);
+    out->production.assign((size_t)n * n, 0.0);
+    out->growthRates.assign(n, 0.0);
+    // Expected ops and cylinders of a rewriting of each symbol
+    std::vector<double> ops(n, 0.0), cylinders(n, 0.0);
+    for (uint32_t s = 0; s < 256; ++s) {
+        const SymbolEntry& entry = grammar.symbols[s];
+        if (entry.count == 0) {
+            continue;
+        }
+        out->symbols[entry.index] = (char)s;
+        float accumulated = 0.0f;
+        for (uint32_t j = 0; j < entry.count; ++j) {
+            const Successor& successor = grammar.successors[entry.first + j];
+            // The last successor takes all the remaining probability
+            const double p = j + 1 == entry.count ? 1.0 - accumulated : successor.probability - accumulated;
+            accumulated = successor.probability;
+            for (uint32_t i = successor.begin; i < successor.end; ++i) {
+                const Op& op = grammar.ops[i];
+                ops[entry.index] += p;
+                cylinders[entry.index] += op.code == OpCode::Forward ? p : 0.0;
+                const SymbolEntry& child = grammar.symbols[(uint8_t)op.symbol];
+                if (child.count != 0) {
+                    out->production[(size_t)entry.index * n + child.index] += p;
+                }
+            }
+        }
+    }
+
+    // The spectral radius of the matrix, with the power method from a positive vector
+    if (n != 0) {
+        std::vector<double> v(n, 1.0 / n), next(n);
+        double logGrowth = 0.0;
+        for (uint32_t k = 0; k < POWER_ITERATIONS; ++k) {
+            std::fill(next.begin(), next.end(), 0.0);
+            for (uint32_t i = 0; i < n; ++i) {
+                for (uint32_t j = 0; j < n; ++j) {
+                    next[i] += out->production[(size_t)i * n + j] * v[j];
+                }
+            }
+            double sum = 0.0;
+            for (const double x : next) {
+                sum += x;
+            }
+            if (sum == 0.0) {
+                logGrowth = -std::numeric_limits<double>::infinity();
+                break;
+            }
+            if (k >= POWER_ITERATIONS / 2) {
+                logGrowth += std::log(sum);
+            }
+            for (uint32_t i = 0; i < n; ++i) {
+                v[i] = next[i] / sum;
+            }
+        }
+        out->dominantEigenvalue = std::exp(logGrowth / (POWER_ITERATIONS / 2));
+    }
+
+    // Expected symbols and cylinders of the rewriting of each symbol with some remaining
+    // depth, each depth from the previous one: S(r) = ops + P S(r - 1), with S(0) = 0
+    std::vector<double> symbols(n, 0.0), symbolCylinders(n, 0.0), previousSymbols(n, 0.0);
+    for (uint32_t depth = 0; depth <= maxDepth; ++depth) {
+        if (depth > 0) {
+            previousSymbols = symbols;
+            std::vector<double> nextCylinders(cylinders);
+            std::vector<double> nextSymbols(ops);
+            for (uint32_t i = 0; i < n; ++i) {
+                for (uint32_t j = 0; j < n; ++j) {
+                    const double p = out->production[(size_t)i * n + j];
+                    nextSymbols[i] += p * symbols[j];
+                    nextCylinders[i] += p * symbolCylinders[j];
+                }
+            }
+            symbols.swap(nextSymbols);
+            symbolCylinders.swap(nextCylinders);
+        }
+
+        DepthPrediction prediction;
+        for (uint32_t i = grammar.axiomBegin; i < grammar.axiomEnd; ++i) {
+            const Op& op = grammar.ops[i];
+            prediction.symbols += 1.0;
+            prediction.cylinders += op.code == OpCode::Forward ? 1.0 : 0.0;
+            const SymbolEntry& entry = grammar.symbols[(uint8_t)op.symbol];
+            if (entry.count != 0) {
+                prediction.symbols += symbols[entry.index];
+                prediction.cylinders += symbolCylinders[entry.index];
+            }
+        }
+        prediction.bytes = prediction.cylinders * sizeof(Cylinder);
+        prediction.seconds = prediction.symbols * nsPerSymbol * 1e-9;
+        out->depths.push_back(prediction);
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        out->growthRates[i] = maxDepth >= 1 && previousSymbols[i] > 0.0 ? symbols[i] / previousSymbols[i] : 0.0;
+    }
+}
+
+uint32_t lParser::largestDepth(const GrowthAnalysis& growth, double maxCylinders, double maxBytes)
+{
+    uint32_t depth = 0;
+    for (uint32_t d = 0; d < growth.depths.size(); ++d) {
+        const DepthPrediction& prediction = growth.depths[d];
+        if (prediction.cylinders <= maxCylinders && prediction.bytes <= maxBytes) {
+            depth = d;
+        }
+    }
+    return depth;
+}
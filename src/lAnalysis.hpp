@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "lParser.hpp"
+
+namespace lParser {
+
+// Size of the model that a grammar generates, computed without running the turtle.
+// For stochastic grammars the counts are upper bounds, and the expected values
+// are given separately. The symbols are the ones of the whole derivation, with every
+// rewriting expanded: the generation replaces the rewritings without geometry by their
+// transform (ParseStats::skippedSubtrees), so it interprets fewer of them.
+struct ParseEstimate {
+	uint64_t cylinders = 0;
+	uint64_t symbols = 0;        // symbols of the expanded derivation, >= ParseStats::symbols
+	uint32_t maxStackDepth = 0;  // pushed turtles
+	double expectedCylinders = 0.0;
+	double expectedSymbols = 0.0;
+	bool exact = true;           // deterministic grammar, the cylinders are exact
+
+	uint64_t bytes() const { return cylinders * sizeof(Cylinder); }
+	// Cylinders to reserve before generating the model: the exact count, or for stochastic
+	// grammars the expected one with RESERVE_HEADROOM, as the bound can be far bigger than
+	// the models generated. Those models may still grow past it.
+	uint64_t reservedCylinders() const;
+	// Same for the symbols, as the modules reserved for a derivation
+	uint64_t reservedSymbols() const;
+};
+
+// Space reserved over the expected cylinders of stochastic models
+static const double RESERVE_HEADROOM = 1.25;
+
+// Count the output of the grammar with dynamic programming over
+// (symbol, remaining depth), so the cost does not depend on the size of the model.
+// Counts that do not fit in 64 bits are saturated. The levels stop once the counts of the
+// axiom are saturated or, for deterministic grammars, stop changing or grow linearly, so
+// only a huge recursion level of a stochastic grammar with slow growth costs one pass per
+// level. The cancel flag and the time limit of the limits stop it: then it returns false,
+// with the counts saturated.
+bool estimate(const Grammar& grammar, ParseEstimate* out, const ParseLimits& limits = ParseLimits());
+
+// Expected model of a grammar at some recursion level
+struct DepthPrediction {
+	double cylinders = 0.0;
+	double symbols = 0.0;
+	double bytes = 0.0;    // of the cylinders
+	double seconds = 0.0;  // at the given cost of a symbol
+};
+
+// Growth of the derivation of a grammar, from its production matrix
+struct GrowthAnalysis {
+	std::vector<char> symbols;       // symbols with rules, in the order of SymbolEntry::index
+	// Expected count of symbol j in a rewriting of symbol i, at [i * symbols.size() + j]
+	std::vector<double> production;
+	// Of each symbol, ratio between the expected symbols of its rewriting at the two deepest levels
+	std::vector<double> growthRates;
+	double dominantEigenvalue = 0.0; // growth factor of the model per level, in the long run
+	std::vector<DepthPrediction> depths; // indexed by recursion level
+};
+
+// Default cost of interpreting a symbol, for the predictions of time
+static const double DEFAULT_NS_PER_SYMBOL = 25.0;
+
+// Analyze the growth of the grammar, and predict its model at each recursion level up to
+// maxDepth. The cost does not depend on the size of the models.
+void analyzeGrowth(const Grammar& grammar, uint32_t maxDepth, double nsPerSymbol, GrowthAnalysis* out);
+
+// Largest recursion level of the analysis whose expected model fits in the cylinders and
+// the bytes, 0 if none does
+uint32_t largestDepth(const GrowthAnalysis& growth, double maxCylinders, double maxBytes);
+
+};
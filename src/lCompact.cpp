@@ -0,0 +1,216 @@
+#include "lCompact.hpp"
+
+#include <cmath>
+#include <limits>
+#include <cassert>
+#include <algorithm>
+
+using namespace lParser;
+
+static const float QUANTIZED_MAX = 65535.0f;
+static const float SNORM_MAX = 32767.0f;
+// Codes of the widths greater than 0
+static const float WIDTH_CODES = 254.0f;
+
+void CylindersSoA::resize(size_t count)
+{
+    initX.resize(count);
+    initY.resize(count);
+    initZ.resize(count);
+    endX.resize(count);
+    endY.resize(count);
+    endZ.resize(count);
+    width.resize(count);
+}
+
+void lParser::toSoA(const Cylinder* cylinders, size_t count, CylindersSoA* out)
+{
+    const size_t first = out->size();
+    out->resize(first + count);
+    for (size_t i = 0; i < count; ++i) {
+        out->initX[first + i] = cylinders[i].init.x;
+        out->initY[first + i] = cylinders[i].init.y;
+        out->initZ[first + i] = cylinders[i].init.z;
+        out->endX[first + i] = cylinders[i].end.x;
+        out->endY[first + i] = cylinders[i].end.y;
+        out->endZ[first + i] = cylinders[i].end.z;
+        out->width[first + i] = cylinders[i].width;
+    }
+}
+
+void lParser::fromSoA(const CylindersSoA& soa, size_t first, size_t count, Cylinder* out)
+{
+    assert(first + count <= soa.size());
+    for (size_t i = 0; i < count; ++i) {
+        out[i].init = glm::vec3(soa.initX[first + i], soa.initY[first + i], soa.initZ[first + i]);
+        out[i].end = glm::vec3(soa.endX[first + i], soa.endY[first + i], soa.endZ[first + i]);
+        out[i].width = soa.width[first + i];
+    }
+}
+
+size_t CompactCylinders::chunkSize(size_t chunk) const
+{
+    return std::min<size_t>(COMPACT_CHUNK_CYLINDERS, cylinders.size() - chunk * COMPACT_CHUNK_CYLINDERS);
+}
+
+uint16_t quantize(float value)
+{
+    return (uint16_t)std::min(std::max(std::round(value), 0.0f), QUANTIZED_MAX);
+}
+
+// Octahedral encoding of a unit vector: projected on the octahedron |x| + |y| + |z| = 1,
+// and the lower half folded over the upper one
+glm::vec2 encodeDirection(const glm::vec3& direction)
+{
+    const glm::vec3 n = direction / (std::abs(direction.x) + std::abs(direction.y) + std::abs(direction.z));
+    if (n.z >= 0.0f) {
+        return glm::vec2(n.x, n.y);
+    }
+    return glm::vec2((1.0f - std::abs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f),
+        (1.0f - std::abs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f));
+}
+
+glm::vec3 decodeDirection(const int16_t* direction)
+{
+    const float x = std::max(direction[0] / SNORM_MAX, -1.0f);
+    const float y = std::max(direction[1] / SNORM_MAX, -1.0f);
+    glm::vec3 n(x, y, 1.0f - std::abs(x) - std::abs(y));
+    const float t = std::max(-n.z, 0.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return glm::normalize(n);
+}
+
+// Quantize up to COMPACT_CHUNK_CYLINDERS cylinders as a new chunk
+void compactChunk(const Cylinder* cylinders, size_t count, CompactCylinders* out)
+{
+    glm::vec3 low(std::numeric_limits<float>::max());
+    glm::vec3 high(-std::numeric_limits<float>::max());
+    float maxLength = 0.0f;
+    float logLow = std::numeric_limits<float>::max();
+    float logHigh = -std::numeric_limits<float>::max();
+    for (size_t i = 0; i < count; ++i) {
+        low = glm::min(low, cylinders[i].init);
+        high = glm::max(high, cylinders[i].init);
+        maxLength = std::max(maxLength, glm::length(cylinders[i].end - cylinders[i].init));
+        if (cylinders[i].width > 0.0f) {
+            logLow = std::min(logLow, std::log2(cylinders[i].width));
+            logHigh = std::max(logHigh, std::log2(cylinders[i].width));
+        }
+    }
+
+    CompactChunk chunk = {};
+    chunk.origin = low;
+    chunk.positionStep = (high - low) / QUANTIZED_MAX;
+    chunk.lengthStep = maxLength / QUANTIZED_MAX;
+    chunk.logWidthMin = logLow <= logHigh ? logLow : 0.0f;
+    chunk.logWidthStep = logLow < logHigh ? (logHigh - logLow) / WIDTH_CODES : 0.0f;
+    out->chunks.push_back(chunk);
+
+    for (size_t i = 0; i < count; ++i) {
+        const Cylinder& c = cylinders[i];
+        CompactCylinder q = {};
+        for (int k = 0; k < 3; ++k) {
+            q.position[k] = chunk.positionStep[k] > 0.0f ? quantize((c.init[k] - low[k]) / chunk.positionStep[k]) : 0;
+        }
+        const float length = glm::length(c.end - c.init);
+        if (length > 0.0f) {
+            q.length = quantize(length / chunk.lengthStep);
+            const glm::vec2 direction = encodeDirection((c.end - c.init) / length);
+            q.direction[0] = (int16_t)std::round(direction.x * SNORM_MAX);
+            q.direction[1] = (int16_t)std::round(direction.y * SNORM_MAX);
+        }
+        if (c.width > 0.0f) {
+            const float code = chunk.logWidthStep > 0.0f ? (std::log2(c.width) - chunk.logWidthMin) / chunk.logWidthStep : 0.0f;
+            q.width = (uint8_t)(1.0f + std::min(std::max(std::round(code), 0.0f), WIDTH_CODES));
+        }
+        out->cylinders.push_back(q);
+    }
+}
+
+void lParser::compact(const Cylinder* cylinders, size_t count, CompactCylinders* out)
+{
+    assert(out->cylinders.size() % COMPACT_CHUNK_CYLINDERS == 0);
+    out->cylinders.reserve(out->cylinders.size() + count);
+    while (count > 0) {
+        const size_t n = std::min<size_t>(count, COMPACT_CHUNK_CYLINDERS);
+        compactChunk(cylinders, n, out);
+        cylinders += n;
+        count -= n;
+    }
+}
+
+// Decode a cylinder with the ranges of its chunk
+Cylinder decodeCylinder(const CompactChunk& chunk, const CompactCylinder& q)
+{
+    Cylinder c;
+    c.init = chunk.origin + glm::vec3(q.position[0], q.position[1], q.position[2]) * chunk.positionStep;
+    c.end = c.init + decodeDirection(q.direction) * (q.length * chunk.lengthStep);
+    c.width = q.width == 0 ? 0.0f : std::exp2(chunk.logWidthMin + (q.width - 1) * chunk.logWidthStep);
+    return c;
+}
+
+void lParser::decode(const CompactCylinders& compacted, size_t chunk, Cylinder* out)
+{
+    const CompactChunk& header = compacted.chunks[chunk];
+    const CompactCylinder* cylinders = compacted.cylinders.data() + chunk * COMPACT_CHUNK_CYLINDERS;
+    const size_t count = compacted.chunkSize(chunk);
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = decodeCylinder(header, cylinders[i]);
+    }
+}
+
+void lParser::decode(const CompactCylinders& compacted, size_t chunk, CylindersSoA* out)
+{
+    const CompactChunk& header = compacted.chunks[chunk];
+    const CompactCylinder* cylinders = compacted.cylinders.data() + chunk * COMPACT_CHUNK_CYLINDERS;
+    const size_t count = compacted.chunkSize(chunk);
+    const size_t first = out->size();
+    out->resize(first + count);
+    for (size_t i = 0; i < count; ++i) {
+        const Cylinder c = decodeCylinder(header, cylinders[i]);
+        out->initX[first + i] = c.init.x;
+        out->initY[first + i] = c.init.y;
+        out->initZ[first + i] = c.init.z;
+        out->endX[first + i] = c.end.x;
+        out->endY[first + i] = c.end.y;
+        out->endZ[first + i] = c.end.z;
+        out->width[first + i] = c.width;
+    }
+}
+
+bool SoASink::consume(const Cylinder* cylinders, size_t count, std::string* /*outErr*/)
+{
+    toSoA(cylinders, count, mSoA);
+    return true;
+}
+
+bool CompactSink::consume(const Cylinder* cylinders, size_t count, std::string* /*outErr*/)
+{
+    while (count > 0) {
+        // Whole chunks are quantized from the batch, the rest waits
+        if (mPending.empty() && count >= COMPACT_CHUNK_CYLINDERS) {
+            const size_t n = count - count % COMPACT_CHUNK_CYLINDERS;
+            compact(cylinders, n, mCompacted);
+            cylinders += n;
+            count -= n;
+            continue;
+        }
+        const size_t n = std::min(count, COMPACT_CHUNK_CYLINDERS - mPending.size());
+        mPending.insert(mPending.end(), cylinders, cylinders + n);
+        cylinders += n;
+        count -= n;
+        if (mPending.size() == COMPACT_CHUNK_CYLINDERS) {
+            compact(mPending.data(), mPending.size(), mCompacted);
+            mPending.clear();
+        }
+    }
+    return true;
+}
+
+bool CompactSink::finish(std::string* /*outErr*/)
+{
+    compact(mPending.data(), mPending.size(), mCompacted);
+    mPending.clear();
+    return true;
+}
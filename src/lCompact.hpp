@@ -0,0 +1,101 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "lParser.hpp"
+#include "lSink.hpp"
+
+namespace lParser {
+
+// Cylinders as a structure of arrays, one array for each component, so the loops
+// over a single component can be vectorized
+struct CylindersSoA {
+	std::vector<float> initX, initY, initZ;
+	std::vector<float> endX, endY, endZ;
+	std::vector<float> width;
+
+	size_t size() const { return width.size(); }
+	size_t bytes() const { return 7 * width.size() * sizeof(float); }
+	void resize(size_t count);
+	void clear() { resize(0); }
+};
+
+// Append the cylinders to the arrays
+void toSoA(const Cylinder* cylinders, size_t count, CylindersSoA* out);
+// Cylinders [first, first + count) of the arrays
+void fromSoA(const CylindersSoA& soa, size_t first, size_t count, Cylinder* out);
+
+// Cylinders of each chunk of a CompactCylinders
+static const uint32_t COMPACT_CHUNK_CYLINDERS = 1 << 12;
+
+// Quantized cylinder, 16 bytes instead of 28. The values are relative to its chunk.
+struct CompactCylinder {
+	uint16_t position[3];  // init, from the origin in steps of positionStep
+	uint16_t length;       // in steps of lengthStep
+	int16_t direction[2];  // unit direction with the octahedral encoding, in snorm16
+	uint8_t width;         // 0 for a width of 0, otherwise the log2 of the width in steps of logWidthStep
+	uint8_t padding[3];
+};
+
+// Ranges of a chunk of cylinders. Its layout is the one of three vec4, as read by the
+// vertex shader of the Renderer.
+struct CompactChunk {
+	glm::vec3 origin;
+	float lengthStep;
+	glm::vec3 positionStep;
+	float logWidthMin;    // log2 of the width of code 1
+	float logWidthStep;
+	float padding[3];
+};
+
+// Model as chunks of COMPACT_CHUNK_CYLINDERS quantized cylinders, all of them full but
+// the last one. The position error is below half a step, 1 / 131070 of the size of the
+// chunk, the direction error is below 1e-4 radians, and the width error below half a
+// step of its log2, 1 / 508 of the range of the chunk.
+struct CompactCylinders {
+	std::vector<CompactChunk> chunks;
+	std::vector<CompactCylinder> cylinders;
+
+	size_t size() const { return cylinders.size(); }
+	size_t bytes() const { return chunks.size() * sizeof(CompactChunk) + cylinders.size() * sizeof(CompactCylinder); }
+	// Cylinders of a chunk, chunk i starts at cylinder i * COMPACT_CHUNK_CYLINDERS
+	size_t chunkSize(size_t chunk) const;
+};
+
+// Quantize the cylinders, appended as new chunks. Only the last chunk of out can be
+// partial, so out has to end in a full chunk unless it is empty.
+void compact(const Cylinder* cylinders, size_t count, CompactCylinders* out);
+
+// Decode the cylinders of a chunk, as the vertex shader of the Renderer does
+void decode(const CompactCylinders& compacted, size_t chunk, Cylinder* out);
+// Same, appended to the arrays
+void decode(const CompactCylinders& compacted, size_t chunk, CylindersSoA* out);
+
+// Append the cylinders to a structure of arrays
+class SoASink : public CylinderSink {
+public:
+	explicit SoASink(CylindersSoA* soa) : mSoA(soa) {}
+
+	bool consume(const Cylinder* cylinders, size_t count, std::string* outErr) override;
+
+private:
+	CylindersSoA* mSoA;
+};
+
+// Quantize the cylinders into full chunks, holding the ones of the last chunk until
+// it is full or the generation finishes
+class CompactSink : public CylinderSink {
+public:
+	explicit CompactSink(CompactCylinders* compacted) : mCompacted(compacted) {}
+
+	bool consume(const Cylinder* cylinders, size_t count, std::string* outErr) override;
+	bool finish(std::string* outErr) override;
+
+private:
+	CompactCylinders* mCompacted;
+	std::vector<Cylinder> mPending;
+};
+
+};
@@ -0,0 +1,588 @@
+#include "lGrammar.hpp"
+#include "lRandom.hpp"
+
+#include <cctype>
+#include <cstdlib>
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <cstdio>
+
+using namespace lParser;
+
+// Levels of the subtree analysis. The deepest levels are the ones that
+// produce most of the work, so there is no need to analyze more.
+static const uint32_t MAX_ANALYZED_LEVELS = 1024;
+// Levels of the cost analysis. It is only used to decide where to split
+// the work, which happens at the shallow levels.
+static const uint32_t MAX_COST_LEVELS = 64;
+static const uint64_t SATURATED = std::numeric_limits<uint64_t>::max();
+
+// Check if the current variable holds some parameter. i.e. F(15).
+// It can be a number or a constant. If no parameter is found, return defaultSlot.
+// Numbers get a new slot, constants use the slot of the constant.
+// The index i_ is the updated index on the axiom string.
+uint32_t checkIfCustomValue(const std::string& axiom, Grammar* grammar, uint32_t defaultSlot, size_t* i_,
+    bool* error, std::string* outErr) {
+    size_t i = *i_;
+    if (axiom.size() <= i + 1 || axiom[i + 1] != '(') {
+        return defaultSlot;
+    }
+
+    // We know that at i+1 there is an (
+    size_t j = axiom.find(')', i + 2);
+    if (j == std::string::npos) {
+        *error |= true;
+        *outErr = "Can't find closing )";
+        return defaultSlot;
+    }
+
+    uint32_t slot;
+    // is constant or value?
+    if (std::isalpha(axiom[i + 2])) {
+        std::string id = axiom.substr(i + 2, j - (i + 2));
+        auto it = grammar->constantSlots.find(id);
+        if (it == grammar->constantSlots.end()) {
+            *error |= true;
+            *outErr = "Can't find constant " + id;
+            slot = defaultSlot;
+        }
+        else {
+            slot = it->second;
+        }
+    }
+    else { // it is a value
+        slot = (uint32_t)grammar->slots.size();
+        grammar->slots.push_back(std::strtof(axiom.c_str() + i + 2, nullptr));
+    }
+
+    (*i_) = j;
+    return slot;
+}
+
+// Translate a mapping string into ops, appended at the end of grammar->ops.
+// Parameters and constants are resolved here, so that they are not parsed again
+// each time the mapping is visited.
+bool compileMapping(const std::string& axiom,
+    Grammar* grammar,
+    std::string* outErr) {
+    bool error = false;
+    for (size_t i = 0; i < axiom.size(); ++i) {
+        const char c = axiom[i];
+        Op op;
+        op.symbol = c;
+        op.axis = Axis::Up;
+        op.negative = false;
+        op.param = SLOT_ONE;
+
+        switch (c)
+        {
+        case 'F':
+            op.code = OpCode::Forward;
+            op.param = checkIfCustomValue(axiom, grammar, SLOT_ONE, &i, &error, outErr);
+            break;
+        case '+':
+        case '-':
+            op.code = OpCode::Rotate;
+            op.axis = Axis::Up;
+            op.param = checkIfCustomValue(axiom, grammar, SLOT_DEFAULT_ANGLE, &i, &error, outErr);
+            break;
+        case '/':
+        case '\\':
+            op.code = OpCode::Rotate;
+            op.axis = Axis::Forward;
+            op.param = checkIfCustomValue(axiom, grammar, SLOT_DEFAULT_ANGLE, &i, &error, outErr);
+            break;
+        case '&':
+        case '^':
+            op.code = OpCode::Rotate;
+            op.axis = Axis::Left;
+            op.param = checkIfCustomValue(axiom, grammar, SLOT_DEFAULT_ANGLE, &i, &error, outErr);
+            break;
+        case '|':
+            op.code = OpCode::Rotate;
+            op.axis = Axis::Left;
+            op.param = SLOT_HALF_TURN;
+            break;
+        case '[':
+            op.code = OpCode::Push;
+            break;
+        case ']':
+            op.code = OpCode::Pop;
+            break;
+        case '<':
+            op.code = OpCode::Shrink;
+            op.param = checkIfCustomValue(axiom, grammar, SLOT_THICKNESS_FACTOR, &i, &error, outErr);
+            break;
+        case '>':
+            op.code = OpCode::Grow;
+            op.param = checkIfCustomValue(axiom, grammar, SLOT_THICKNESS_FACTOR, &i, &error, outErr);
+            break;
+        default:
+            // Symbols without rules do nothing, so they are not stored
+            if (!std::isalpha(c) || grammar->symbols[(uint8_t)c].count == 0) {
+                continue;
+            }
+            op.code = OpCode::Symbol;
+            break;
+        }
+
+        if (error) {
+            return false;
+        }
+        op.negative = c == '-' || c == '\\' || c == '^';
+
+        grammar->ops.push_back(op);
+    }
+
+    return true;
+}
+
+// Ops that only change the rotation or thickness of the turtle
+bool isTransform(const Op& op) {
+    return op.code == OpCode::Rotate || op.code == OpCode::Grow || op.code == OpCode::Shrink;
+}
+
+// Peephole pass over the ops from begin to the end of grammar->ops. Each run of
+// consecutive rotations and thickness changes is folded into a single Transform op.
+// Single rotations become a Transform too, so that the interpreter only
+// multiplies by precomputed quaternions. Returns the number of removed ops.
+uint32_t foldTransforms(uint32_t begin, Grammar* grammar) {
+    std::vector<Op>& ops = grammar->ops;
+    const uint32_t end = (uint32_t)ops.size();
+    uint32_t out = begin;
+    uint32_t i = begin;
+    while (i < end) {
+        uint32_t j = i;
+        while (j < end && isTransform(ops[j])) {
+            ++j;
+        }
+        if (j == i || (j - i == 1 && ops[i].code != OpCode::Rotate)) {
+            ops[out++] = ops[i++];
+            continue;
+        }
+
+        Transform transform;
+        transform.first = (uint32_t)grammar->transformOps.size();
+        transform.count = j - i;
+        grammar->transformOps.insert(grammar->transformOps.end(), ops.begin() + i, ops.begin() + j);
+
+        Op op;
+        op.code = OpCode::Transform;
+        op.axis = Axis::Up;
+        op.negative = false;
+        op.symbol = '\0';
+        op.param = (uint32_t)grammar->transforms.size();
+        grammar->transforms.push_back(transform);
+        ops[out++] = op;
+        i = j;
+    }
+    ops.resize(out);
+    return end - out;
+}
+
+// Match the brackets of the ops from begin to the end of grammar->ops.
+// Returns false if some bracket is not closed, or closes a previous mapping.
+bool matchBrackets(uint32_t begin, Grammar* grammar) {
+    std::vector<uint32_t> open;
+    bool balanced = true;
+    for (uint32_t i = begin; i < (uint32_t)grammar->ops.size(); ++i) {
+        Op& op = grammar->ops[i];
+        if (op.code == OpCode::Push) {
+            op.param = NO_BRACKET;
+            open.push_back(i);
+        }
+        else if (op.code == OpCode::Pop) {
+            if (open.empty()) {
+                balanced = false;
+                continue;
+            }
+            grammar->ops[open.back()].param = (uint32_t)grammar->brackets.size();
+            grammar->brackets.push_back({ open.back(), i });
+            open.pop_back();
+        }
+    }
+    return balanced && open.empty();
+}
+
+// Write a probability for the diagnostics
+std::string probabilityString(double p) {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%g", p);
+    return text;
+}
+
+// Build the alias table of a symbol from the probabilities of its successors,
+// already normalized to add up to 1
+void buildAliasTable(const std::vector<double>& probabilities, Alias* table) {
+    const uint32_t count = (uint32_t)probabilities.size();
+    std::vector<double> scaled(count);
+    std::vector<uint32_t> small, large;
+    for (uint32_t i = 0; i < count; ++i) {
+        scaled[i] = probabilities[i] * count;
+        (scaled[i] < 1.0 ? small : large).push_back(i);
+    }
+    // Each bucket below 1 is filled with a part of a bucket above 1
+    while (!small.empty() && !large.empty()) {
+        const uint32_t s = small.back();
+        small.pop_back();
+        const uint32_t l = large.back();
+        table[s] = { (float)scaled[s], l };
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // The rest are full, up to rounding
+    for (const uint32_t i : small) {
+        table[i] = { 1.0f, i };
+    }
+    for (const uint32_t i : large) {
+        table[i] = { 1.0f, i };
+    }
+}
+
+// Add the successors of a symbol, checking that their probabilities are a distribution
+bool addSuccessors(char symbol, const std::vector<const Rule*>& rules, Grammar* grammar, std::string* outErr) {
+    SymbolEntry& entry = grammar->symbols[(uint8_t)symbol];
+    entry.index = grammar->ruleSymbolCount++;
+    entry.first = (uint32_t)grammar->successors.size();
+    entry.count = (uint32_t)rules.size();
+    grammar->stochastic |= entry.count > 1;
+
+    double total = 0.0;
+    for (const Rule* rule : rules) {
+        if (!(rule->probability >= 0.0f) || std::isinf(rule->probability)) {
+            *outErr = "A rule of " + std::string(1, symbol) + " has the probability " +
+                probabilityString(rule->probability) + ", it must be between 0 and 1";
+            return false;
+        }
+        total += rule->probability;
+    }
+    if (std::abs(total - 1.0) > 1e-2) {
+        *outErr = "The probabilities of the rules of " + std::string(1, symbol) + " add up to " +
+            probabilityString(total) + ", not to 1";
+        return false;
+    }
+
+    float accum = 0.0f;
+    for (const Rule* rule : rules) {
+        accum += rule->probability;
+        grammar->successors.push_back({ accum, 0, 0 });
+    }
+    grammar->aliases.resize(grammar->successors.size(), { 1.0f, 0 });
+    if (entry.count >= MIN_ALIAS_SUCCESSORS) {
+        std::vector<double> probabilities;
+        for (const Rule* rule : rules) {
+            probabilities.push_back(rule->probability / total);
+        }
+        buildAliasTable(probabilities, &grammar->aliases[entry.first]);
+    }
+    return true;
+}
+
+// Compute the folded transforms with the current value of the slots
+void updateTransforms(Grammar* grammar) {
+    for (Transform& transform : grammar->transforms) {
+        transform.rotation = glm::quat(1.f, glm::vec3(0.f));
+        transform.thickness = 1.0f;
+        for (uint32_t i = transform.first; i < transform.first + transform.count; ++i) {
+            const Op& op = grammar->transformOps[i];
+            if (op.code == OpCode::Rotate) {
+                transform.rotation = transform.rotation * localRotation(op, *grammar);
+            }
+            else if (op.code == OpCode::Grow) {
+                transform.thickness *= grammar->slots[op.param];
+            }
+            else {
+                transform.thickness /= grammar->slots[op.param];
+            }
+        }
+    }
+}
+
+bool lParser::compile(const LParserInfo& info, Grammar* grammar, std::string* outErr)
+{
+    assert(grammar != nullptr && outErr != nullptr);
+
+    *grammar = Grammar();
+
+    // Group the rules by symbol
+    std::vector<const Rule*> symbolRules[256];
+    for (const Rule& rule : info.rules) {
+        if (rule.id.empty()) {
+            *outErr = "There is a rule without ID";
+            return false;
+        }
+        if (!std::isalpha(rule.id.front())) {
+            *outErr = rule.id + " has not a char as an identifier";
+            return false;
+        }
+        symbolRules[(uint8_t)rule.id.front()].push_back(&rule);
+    }
+
+    // Fill the symbol table, and check correct distributions
+    for (uint32_t c = 0; c < 256; ++c) {
+        if (!symbolRules[c].empty() && !addSuccessors((char)c, symbolRules[c], grammar, outErr)) {
+            return false;
+        }
+    }
+
+    // Fixed slots, and one slot for each constant
+    grammar->slots.resize(SLOT_COUNT);
+    grammar->slots[SLOT_HALF_TURN] = 180.0f;
+    for (const auto& c : info.constants) {
+        if (grammar->constantSlots.emplace(c.first, (uint32_t)grammar->slots.size()).second) {
+            grammar->slots.push_back(c.second);
+        }
+    }
+
+    // Compile the mappings of all the rules
+    grammar->removedOps.resize(info.rules.size(), 0);
+    for (uint32_t c = 0; c < 256; ++c) {
+        const SymbolEntry& entry = grammar->symbols[c];
+        for (uint32_t i = 0; i < entry.count; ++i) {
+            Successor& successor = grammar->successors[entry.first + i];
+            successor.begin = (uint32_t)grammar->ops.size();
+            if (!compileMapping(symbolRules[c][i]->mapping, grammar, outErr)) {
+                return false;
+            }
+            grammar->removedOps[symbolRules[c][i] - info.rules.data()] = foldTransforms(successor.begin, grammar);
+            grammar->balancedRules &= matchBrackets(successor.begin, grammar);
+            successor.end = (uint32_t)grammar->ops.size();
+        }
+    }
+
+    // And the axiom
+    grammar->axiomBegin = (uint32_t)grammar->ops.size();
+    if (!compileMapping(info.axiom, grammar, outErr)) {
+        return false;
+    }
+    grammar->axiomRemovedOps = foldTransforms(grammar->axiomBegin, grammar);
+    matchBrackets(grammar->axiomBegin, grammar);
+    grammar->axiomEnd = (uint32_t)grammar->ops.size();
+
+    // Set the values of the slots, and analyze the rules with them
+    updateParameters(info, grammar);
+
+    return true;
+}
+
+glm::quat lParser::localRotation(const Op& op, const Grammar& grammar)
+{
+    static const glm::vec3 axes[] = {
+        glm::vec3(0.f, 0.f, 1.f),   // up
+        glm::vec3(0.f, 1.f, 0.f),   // forward
+        glm::vec3(-1.f, 0.f, 0.f)   // left
+    };
+    float angle = glm::radians(grammar.slots[op.param]);
+    if (op.negative) {
+        angle = -angle;
+    }
+    return glm::quat(std::cos(angle * 0.5f), axes[(uint32_t)op.axis] * std::sin(angle * 0.5f));
+}
+
+// Find which rewritings, with some remaining depth, do not draw anything and
+// leave the turtle stack as it was. Those can be replaced by their net effect
+// on the turtle, a rotation and a thickness factor.
+// Stochastic symbols are never replaced, as that would change the random sequence.
+void analyzeSubtrees(Grammar* grammar) {
+    grammar->analyzedLevels = std::min(grammar->maxRecursionLevel, MAX_ANALYZED_LEVELS);
+    grammar->subtrees.resize((size_t)grammar->analyzedLevels * grammar->ruleSymbolCount);
+
+    struct State {
+        glm::quat rotation;
+        float thickness;
+    };
+    std::vector<State> stack;
+    for (uint32_t remaining = 0; remaining < grammar->analyzedLevels; ++remaining) {
+        const Subtree* children = remaining == 0 ? nullptr :
+            &grammar->subtrees[(size_t)(remaining - 1) * grammar->ruleSymbolCount];
+        for (uint32_t c = 0; c < 256; ++c) {
+            const SymbolEntry& entry = grammar->symbols[c];
+            if (entry.count == 0) {
+                continue;
+            }
+            Subtree& subtree = grammar->subtrees[(size_t)remaining * grammar->ruleSymbolCount + entry.index];
+            subtree.skip = entry.count == 1;
+
+            State state = { glm::quat(1.f, glm::vec3(0.f)), 1.0f };
+            stack.clear();
+            const Successor& successor = grammar->successors[entry.first];
+            for (uint32_t i = successor.begin; subtree.skip && i < successor.end; ++i) {
+                const Op& op = grammar->ops[i];
+                switch (op.code)
+                {
+                case OpCode::Forward:
+                    subtree.skip = false;
+                    break;
+                case OpCode::Rotate:
+                    state.rotation = state.rotation * localRotation(op, *grammar);
+                    break;
+                case OpCode::Push:
+                    stack.push_back(state);
+                    break;
+                case OpCode::Pop:
+                    if (stack.empty()) {
+                        subtree.skip = false;
+                    }
+                    else {
+                        state = stack.back();
+                        stack.pop_back();
+                    }
+                    break;
+                case OpCode::Shrink:
+                    state.thickness /= grammar->slots[op.param];
+                    break;
+                case OpCode::Grow:
+                    state.thickness *= grammar->slots[op.param];
+                    break;
+                case OpCode::Transform:
+                    state.rotation = state.rotation * grammar->transforms[op.param].rotation;
+                    state.thickness *= grammar->transforms[op.param].thickness;
+                    break;
+                case OpCode::Symbol:
+                    break;
+                }
+
+                const SymbolEntry& child = grammar->symbols[(uint8_t)op.symbol];
+                if (child.count != 0 && children != nullptr) {
+                    const Subtree& childSubtree = children[child.index];
+                    subtree.skip &= childSubtree.skip;
+                    state.rotation = state.rotation * childSubtree.rotation;
+                    state.thickness *= childSubtree.thickness;
+                }
+            }
+            subtree.skip &= stack.empty();
+            subtree.rotation = state.rotation;
+            subtree.thickness = state.thickness;
+            subtree.identity = subtree.skip && state.thickness == 1.0f &&
+                state.rotation == glm::quat(1.f, glm::vec3(0.f));
+        }
+    }
+}
+
+// Bound the symbols interpreted in the contents of each bracket, for each remaining depth.
+// The remaining depth of a range of ops is the number of levels that their symbols
+// can still be rewritten.
+void analyzeCosts(Grammar* grammar) {
+    grammar->costLevels = std::min(grammar->maxRecursionLevel + 1, MAX_COST_LEVELS);
+    grammar->bracketCosts.resize((size_t)grammar->costLevels * grammar->brackets.size());
+
+    // Cost of a range of ops, with the costs of the rewritten symbols of the level below
+    auto rangeCost = [grammar](uint32_t begin, uint32_t end, const uint64_t* children) {
+        uint64_t cost = 0;
+        for (uint32_t i = begin; i < end; ++i) {
+            const SymbolEntry& entry = grammar->symbols[(uint8_t)grammar->ops[i].symbol];
+            const uint64_t child = children != nullptr && entry.count != 0 ? children[entry.index] : 0;
+            cost = child >= SATURATED - cost ? SATURATED : cost + 1 + child;
+        }
+        return cost;
+    };
+
+    std::vector<uint64_t> previous(grammar->ruleSymbolCount), current(grammar->ruleSymbolCount);
+    for (uint32_t remaining = 0; remaining < grammar->costLevels; ++remaining) {
+        const uint64_t* children = remaining == 0 ? nullptr : previous.data();
+        for (size_t b = 0; b < grammar->brackets.size(); ++b) {
+            const Bracket& bracket = grammar->brackets[b];
+            grammar->bracketCosts[remaining * grammar->brackets.size() + b] =
+                rangeCost(bracket.push + 1, bracket.pop, children);
+        }
+        for (uint32_t c = 0; c < 256; ++c) {
+            const SymbolEntry& entry = grammar->symbols[c];
+            if (entry.count == 0) {
+                continue;
+            }
+            uint64_t cost = 0;
+            for (uint32_t j = 0; j < entry.count; ++j) {
+                const Successor& successor = grammar->successors[entry.first + j];
+                cost = std::max(cost, rangeCost(successor.begin, successor.end, children));
+            }
+            current[entry.index] = cost;
+        }
+        previous.swap(current);
+    }
+}
+
+// Change the value of a constant, without updating the analysis
+bool patchConstant(const std::string& id, float value, Grammar* grammar) {
+    auto it = grammar->constantSlots.find(id);
+    if (it == grammar->constantSlots.end()) {
+        return false;
+    }
+    grammar->slots[it->second] = value;
+    return true;
+}
+
+bool lParser::setConstant(const std::string& id, float value, Grammar* grammar)
+{
+    if (!patchConstant(id, value, grammar)) {
+        return false;
+    }
+    updateTransforms(grammar);
+    analyzeSubtrees(grammar);
+    return true;
+}
+
+bool lParser::updateParameters(const LParserInfo& info, Grammar* grammar)
+{
+    grammar->slots[SLOT_ONE] = 1.0f;
+    grammar->slots[SLOT_DEFAULT_ANGLE] = info.defaultAngle;
+    grammar->slots[SLOT_THICKNESS_FACTOR] = info.thicknessReductionFactor;
+    grammar->defaultThickness = info.defaultThickness;
+    grammar->rngSeed = info.rngSeed;
+    grammar->rngMode = info.rngMode;
+    grammar->numThreads = std::max(info.numThreads, 1u);
+
+    bool found = true;
+    // With repeated ids, the first one is the one used
+    for (auto it = info.constants.rbegin(); it != info.constants.rend(); ++it) {
+        found &= patchConstant(it->first, it->second, grammar);
+    }
+    updateTransforms(grammar);
+    setMaxRecursionLevel(info.maxRecursionLevel, grammar);
+    return found;
+}
+
+uint64_t lParser::derivationKey(const Grammar& grammar)
+{
+    return derivationKey(grammar, grammar.maxRecursionLevel);
+}
+
+uint64_t lParser::derivationKey(const Grammar& grammar, uint32_t maxRecursionLevel)
+{
+    uint64_t key = mixBits(grammar.ops.size());
+    auto add = [&key](uint64_t value) {
+        key = mixBits(key ^ value);
+    };
+    for (const Op& op : grammar.ops) {
+        add((uint64_t)op.code | (uint64_t)op.axis << 8 | (uint64_t)op.negative << 16 |
+            (uint64_t)(uint8_t)op.symbol << 24 | (uint64_t)op.param << 32);
+    }
+    for (const Successor& successor : grammar.successors) {
+        uint32_t probability;
+        std::memcpy(&probability, &successor.probability, sizeof(probability));
+        add(probability);
+        add((uint64_t)successor.begin | (uint64_t)successor.end << 32);
+    }
+    for (const SymbolEntry& entry : grammar.symbols) {
+        add((uint64_t)entry.first | (uint64_t)entry.count << 32);
+    }
+    add((uint64_t)grammar.axiomBegin | (uint64_t)grammar.axiomEnd << 32);
+    add(maxRecursionLevel);
+    add((uint64_t)(uint32_t)grammar.rngSeed | (uint64_t)grammar.rngMode << 32);
+    return key != 0 ? key : 1;
+}
+
+void lParser::setMaxRecursionLevel(uint32_t maxRecursionLevel, Grammar* grammar)
+{
+    grammar->maxRecursionLevel = maxRecursionLevel;
+    for (SymbolEntry& entry : grammar->symbols) {
+        entry.expandDepth = entry.count != 0 ? maxRecursionLevel : 0;
+    }
+    analyzeSubtrees(grammar);
+    analyzeCosts(grammar);
+}
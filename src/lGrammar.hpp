@@ -0,0 +1,167 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include "lParser.hpp"
+
+namespace lParser {
+
+// Operations of a compiled grammar
+enum class OpCode : uint8_t {
+	Forward,    // F, also a symbol that may be rewritten
+	Rotate,     // + - / \ & ^ |, only as source of a Transform
+	Push,       // [
+	Pop,        // ]
+	Grow,       // >
+	Shrink,     // <
+	Transform,  // run of rotations and thickness changes, folded into one op
+	Symbol      // any other character with a rule
+};
+
+enum class Axis : uint8_t {
+	Up, Forward, Left
+};
+
+// A single compiled operation.
+// The parameter is an index into Grammar::slots, so it can be changed
+// without compiling again the rules. For Transform ops it is an index
+// into Grammar::transforms.
+struct Op {
+	OpCode code;
+	Axis axis;
+	bool negative;      // rotation in the opposite direction
+	char symbol;
+	uint32_t param;
+};
+
+// One of the possible mappings of a symbol, as a range of ops
+struct Successor {
+	float probability; // accumulated probability
+	uint32_t begin, end;
+};
+
+// Bucket of the alias table of a symbol (Vose's alias method). A uniform value u picks
+// the bucket floor(u * count), which gives its own successor when the fraction left is
+// below the threshold, and the alias otherwise. Sampling is constant time.
+struct Alias {
+	float threshold;
+	uint32_t alias; // successor index, relative to SymbolEntry::first
+};
+
+// Symbols with fewer successors are sampled with a scan of the accumulated probabilities
+static const uint32_t MIN_ALIAS_SUCCESSORS = 8;
+
+// Folded run of ops. The source ops are kept to compute it again when
+// the parameters change.
+struct Transform {
+	glm::quat rotation;  // in the local frame of the turtle
+	float thickness;     // factor applied to the thickness
+	uint32_t first, count; // range of source ops in Grammar::transformOps
+};
+
+// Entry of the symbol dispatch table, indexed by the symbol byte
+struct SymbolEntry {
+	uint32_t first = 0, count = 0; // range of successors of the symbol
+	uint32_t expandDepth = 0;      // the symbol is rewritten while depth < expandDepth
+	uint32_t index = 0;            // position among the symbols with rules
+};
+
+// Net effect of rewriting a symbol with some remaining depth, when it
+// does not draw anything and leaves the turtle stack as it was
+struct Subtree {
+	glm::quat rotation;  // applied in the local frame of the turtle
+	float thickness;     // factor applied to the thickness
+	bool skip;           // the rewriting can be replaced by this transform
+	bool identity;       // and it does not change the turtle at all
+};
+
+// Brackets [ ] closed in the same mapping. The param of a Push op is the index of
+// its bracket, or NO_BRACKET. The contents of such a bracket can be generated
+// independently when the rules are balanced.
+static const uint32_t NO_BRACKET = 0xFFFFFFFF;
+struct Bracket {
+	uint32_t push, pop; // indices of the ops
+};
+
+// Fixed parameter slots, the rest are constants and literal values
+enum ParamSlot : uint32_t {
+	SLOT_ONE = 0,           // default advance of F
+	SLOT_HALF_TURN,         // angle of |
+	SLOT_DEFAULT_ANGLE,
+	SLOT_THICKNESS_FACTOR,
+	SLOT_COUNT
+};
+
+// Grammar translated from the strings of LParserInfo into op streams
+struct Grammar {
+	std::vector<Op> ops;
+	std::vector<Successor> successors;
+	// Indexed as successors, only for the symbols with MIN_ALIAS_SUCCESSORS or more
+	std::vector<Alias> aliases;
+	SymbolEntry symbols[256];
+	uint32_t axiomBegin = 0, axiomEnd = 0;
+
+	std::vector<Transform> transforms;
+	std::vector<Op> transformOps;
+	// Ops removed by folding transforms, for each rule in the order of
+	// LParserInfo::rules, and for the axiom
+	std::vector<uint32_t> removedOps;
+	uint32_t axiomRemovedOps = 0;
+
+	// Values of the parameters. Angles are stored in degrees.
+	std::vector<float> slots;
+	std::unordered_map<std::string, uint32_t> constantSlots;
+
+	uint32_t maxRecursionLevel = 0;
+	float defaultThickness = 0.05f;
+	int32_t rngSeed = 0;
+	RngMode rngMode = RngMode::Sequential;
+	uint32_t numThreads = 1;
+	bool stochastic = false;       // some symbol has more than one rule
+
+	std::vector<Bracket> brackets;
+	bool balancedRules = true;     // every mapping of the rules closes all its brackets
+	// Upper bound of the symbols interpreted in the contents of each bracket, for remaining
+	// depths lower than costLevels. Indexed by remaining * brackets.size() + bracket.
+	// Deeper levels cost at least as much as the last one.
+	uint32_t costLevels = 0;
+	std::vector<uint64_t> bracketCosts;
+
+	// Subtree of each symbol with rules, for the remaining depths lower than analyzedLevels.
+	// Indexed by remaining * ruleSymbolCount + SymbolEntry::index.
+	uint32_t ruleSymbolCount = 0;
+	uint32_t analyzedLevels = 0;
+	std::vector<Subtree> subtrees;
+};
+
+// Rotation of a rotation op, in the local frame of the turtle
+glm::quat localRotation(const Op& op, const Grammar& grammar);
+
+// Compile the rules and the axiom of the info into a grammar.
+// If returns false, an error has occurred, and string outErr contains an error message.
+bool compile(const LParserInfo& info, Grammar* grammar, std::string* outErr);
+
+// Change the value of a constant, without compiling again the rules.
+// Returns false if the grammar has no such constant.
+bool setConstant(const std::string& id, float value, Grammar* grammar);
+
+// Change the recursion level, updating the symbol table
+void setMaxRecursionLevel(uint32_t maxRecursionLevel, Grammar* grammar);
+
+// Update the values that do not change the rules (default values, seed, recursion
+// and constants) from the info. Returns false if some constant is not in the grammar.
+bool updateParameters(const LParserInfo& info, Grammar* grammar);
+
+// Hash of what decides the derivation of the grammar: the ops and the successors of the
+// axiom and the rules, the recursion level and the random generator. The values of the
+// parameters are not part of it, so a Derivation can be interpreted again after changing them.
+// Never 0.
+uint64_t derivationKey(const Grammar& grammar);
+// Same, as if the grammar had another recursion level
+uint64_t derivationKey(const Grammar& grammar, uint32_t maxRecursionLevel);
+
+};
@@ -0,0 +1,219 @@
+#include "lInstanced.hpp"
+#include "lGrammar.hpp"
+#include "lTurtle.hpp"
+
+#include <chrono>
+#include <limits>
+#include <cassert>
+#include <algorithm>
+
+using namespace lParser;
+
+static const uint64_t SATURATED = std::numeric_limits<uint64_t>::max();
+
+// Net effect of a node on the turtle that rewrites it, in its local frame
+struct NodeEnd {
+    glm::vec3 position;
+    glm::quat rotation;
+    float thickness;
+};
+
+// Limit exceeded by the nodes built so far, or Ok
+static ParseResult instancedLimit(const InstancedOut& out, const std::vector<NodeEnd>& ends,
+    const ParseLimits& limits, const std::chrono::steady_clock::time_point& start) {
+    if (limits.progress != nullptr) {
+        limits.progress->symbols = out.stats.symbols;
+        limits.progress->cylinders = out.cylinders.size();
+    }
+    return exceededLimit(limits, out.cylinders.size(), out.bytes() + ends.capacity() * sizeof(NodeEnd), start);
+}
+
+// Build a node from a range of ops. The rewritten symbols use the nodes of
+// the level below, in levelBelow indexed by SymbolEntry::index.
+bool buildNode(const Grammar& grammar, uint32_t begin, uint32_t end, const uint32_t* levelBelow,
+    float thickness, std::vector<NodeEnd>* ends, std::vector<Turtle>* turtleStack,
+    InstancedOut* out, std::string* outErr) {
+    InstanceNode node;
+    node.firstCylinder = (uint32_t)out->cylinders.size();
+    node.firstInstance = (uint32_t)out->instances.size();
+    Turtle turtle;
+    turtle.thickness = thickness;
+    turtleStack->clear();
+    Cylinder cylinder;
+
+    for (uint32_t i = begin; i < end; ++i) {
+        const Op& op = grammar.ops[i];
+        out->stats.symbols += 1;
+        switch (op.code)
+        {
+        case OpCode::Forward:
+            cylinder.width = turtle.thickness;
+            cylinder.init = turtle.pos;
+            turtle.advance(grammar.slots[op.param]);
+            cylinder.end = turtle.pos;
+            out->cylinders.push_back(cylinder);
+            break;
+        case OpCode::Push:
+            turtleStack->push_back(turtle);
+            out->stats.maxTurtles = std::max(out->stats.maxTurtles, (uint32_t)turtleStack->size());
+            break;
+        case OpCode::Pop:
+            if (turtleStack->empty()) {
+                *outErr = "Too many closing ] symbols";
+                return false;
+            }
+            turtle = turtleStack->back();
+            turtleStack->pop_back();
+            break;
+        case OpCode::Shrink:
+            turtle.thickness /= grammar.slots[op.param];
+            break;
+        case OpCode::Grow:
+            turtle.thickness *= grammar.slots[op.param];
+            break;
+        case OpCode::Transform:
+            turtle.rotateLocal(grammar.transforms[op.param].rotation);
+            turtle.thickness *= grammar.transforms[op.param].thickness;
+            break;
+        case OpCode::Rotate: // always folded into transforms
+        case OpCode::Symbol:
+            break;
+        }
+
+        const SymbolEntry& entry = grammar.symbols[(uint8_t)op.symbol];
+        if (entry.count == 0 || levelBelow == nullptr) {
+            continue;
+        }
+        const uint32_t child = levelBelow[entry.index];
+        // Nodes without geometry only move the turtle
+        if (out->nodes[child].flatCylinders != 0) {
+            out->instances.push_back({ turtle.rotation, turtle.pos, turtle.thickness, child });
+        }
+        const NodeEnd& childEnd = (*ends)[child];
+        turtle.pos += glm::rotate(turtle.rotation, childEnd.position);
+        turtle.rotateLocal(childEnd.rotation);
+        turtle.thickness *= childEnd.thickness;
+    }
+
+    node.cylinderCount = (uint32_t)out->cylinders.size() - node.firstCylinder;
+    node.instanceCount = (uint32_t)out->instances.size() - node.firstInstance;
+    node.flatCylinders = node.cylinderCount;
+    for (uint32_t i = node.firstInstance; i < node.firstInstance + node.instanceCount; ++i) {
+        const uint64_t child = out->nodes[out->instances[i].node].flatCylinders;
+        node.flatCylinders = child >= SATURATED - node.flatCylinders ? SATURATED : node.flatCylinders + child;
+    }
+    out->nodes.push_back(node);
+    ends->push_back({ turtle.pos, turtle.rotation, turtle.thickness });
+    return true;
+}
+
+bool lParser::parseInstanced(const Grammar& grammar, InstancedOut* out, std::string* outErr,
+    const ParseLimits& limits)
+{
+    assert(out != nullptr && outErr != nullptr);
+    *out = InstancedOut();
+
+    if (grammar.stochastic || !grammar.balancedRules) {
+        *outErr = "Only deterministic grammars whose rules close their brackets can be instanced";
+        out->stats.result = ParseResult::GrammarError;
+        return false;
+    }
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // The nodes of each level only need the ones of the level below.
+    // A node of level r interprets a mapping whose symbols can still be rewritten r times.
+    std::vector<uint32_t> previous(grammar.ruleSymbolCount), current(grammar.ruleSymbolCount);
+    std::vector<NodeEnd> ends;
+    std::vector<Turtle> turtleStack;
+    uint64_t nextCheck = 0;
+    bool ret = true;
+    uint32_t level = 0;
+    for (; level < grammar.maxRecursionLevel; ++level) {
+        for (uint32_t c = 0; c < 256; ++c) {
+            const SymbolEntry& entry = grammar.symbols[c];
+            if (entry.count == 0) {
+                continue;
+            }
+            if (out->stats.symbols >= nextCheck) {
+                nextCheck = out->stats.symbols + LIMIT_CHECK_SYMBOLS;
+                out->stats.result = instancedLimit(*out, ends, limits, start);
+                if (out->stats.result != ParseResult::Ok) {
+                    *outErr = limitMessage(out->stats.result);
+                    ret = false;
+                    break;
+                }
+            }
+            const Successor& successor = grammar.successors[entry.first];
+            current[entry.index] = (uint32_t)out->nodes.size();
+            if (!buildNode(grammar, successor.begin, successor.end, level == 0 ? nullptr : previous.data(),
+                1.0f, &ends, &turtleStack, out, outErr)) {
+                out->stats.result = ParseResult::GrammarError;
+                return false;
+            }
+        }
+        if (!ret) {
+            break;
+        }
+        previous.swap(current);
+    }
+
+    if (ret) {
+        out->root = (uint32_t)out->nodes.size();
+        ret = buildNode(grammar, grammar.axiomBegin, grammar.axiomEnd,
+            grammar.maxRecursionLevel == 0 ? nullptr : previous.data(),
+            grammar.defaultThickness, &ends, &turtleStack, out, outErr);
+        if (!ret) {
+            out->stats.result = ParseResult::GrammarError;
+        }
+    }
+    else {
+        // Without the levels above them, the nodes built so far are not a model
+        const ParseStats stats = out->stats;
+        *out = InstancedOut();
+        out->stats = stats;
+    }
+
+    out->stats.cylinders = out->cylinders.size();
+    out->stats.maxFrames = level;
+    out->stats.stackBytes = turtleStack.capacity() * sizeof(Turtle);
+    out->stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return ret;
+}
+
+void lParser::flatten(const InstancedOut& model, uint32_t node, std::vector<Cylinder>* cylinders)
+{
+    assert(cylinders != nullptr && node < model.nodes.size());
+
+    // Pending nodes with their transform to the frame of the first one
+    struct Placement {
+        glm::quat rotation;
+        glm::vec3 translation;
+        float widthScale;
+        uint32_t node;
+    };
+    std::vector<Placement> stack;
+    stack.push_back({ glm::quat(1.f, glm::vec3(0.f)), glm::vec3(0.f), 1.0f, node });
+    if (model.nodes[node].flatCylinders != SATURATED) {
+        cylinders->reserve(cylinders->size() + (size_t)model.nodes[node].flatCylinders);
+    }
+
+    while (!stack.empty()) {
+        const Placement p = stack.back();
+        stack.pop_back();
+        const InstanceNode& n = model.nodes[p.node];
+        for (uint32_t i = n.firstCylinder; i < n.firstCylinder + n.cylinderCount; ++i) {
+            const Cylinder& c = model.cylinders[i];
+            cylinders->push_back({ p.translation + glm::rotate(p.rotation, c.init),
+                p.translation + glm::rotate(p.rotation, c.end),
+                p.widthScale * c.width });
+        }
+        for (uint32_t i = n.firstInstance; i < n.firstInstance + n.instanceCount; ++i) {
+            const Instance& instance = model.instances[i];
+            stack.push_back({ p.rotation * instance.rotation,
+                p.translation + glm::rotate(p.rotation, instance.translation),
+                p.widthScale * instance.widthScale,
+                instance.node });
+        }
+    }
+}
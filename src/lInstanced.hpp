@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include "lParser.hpp"
+
+namespace lParser {
+
+struct Grammar;
+
+// Placement of a node inside its parent node
+struct Instance {
+	glm::quat rotation;
+	glm::vec3 translation;
+	float widthScale;   // thickness of the turtle when the node starts
+	uint32_t node;
+};
+
+// Geometry of a rewritten symbol with some remaining depth, in the local frame of the
+// turtle that rewrites it and for a thickness of 1. Its rewritten symbols are instances.
+struct InstanceNode {
+	uint32_t firstCylinder = 0, cylinderCount = 0;  // in InstancedOut::cylinders
+	uint32_t firstInstance = 0, instanceCount = 0;  // in InstancedOut::instances
+	uint64_t flatCylinders = 0; // cylinders of the node with all its instances, saturated
+};
+
+// Model as a DAG of nodes. In a deterministic grammar, a symbol rewritten with the same
+// remaining depth always draws the same geometry relative to the turtle, and the widths
+// are proportional to the thickness of the turtle, so each (symbol, depth) is generated once.
+struct InstancedOut {
+	std::vector<Cylinder> cylinders;
+	std::vector<Instance> instances;
+	std::vector<InstanceNode> nodes; // children are always before their parents
+	uint32_t root = 0;               // in world space, with the default thickness
+	ParseStats stats;
+
+	uint64_t flatCylinders() const { return nodes.empty() ? 0 : nodes[root].flatCylinders; }
+	size_t bytes() const {
+		return cylinders.size() * sizeof(Cylinder) + instances.size() * sizeof(Instance) +
+			nodes.size() * sizeof(InstanceNode);
+	}
+};
+
+// Generate the model of a grammar as a DAG of instances.
+// Only deterministic grammars whose rules close all their brackets can be instanced.
+// If returns false, an error has occurred, and string outErr contains an error message.
+// The limits are checked while the levels of nodes are built. A generation stopped by them
+// has no model, as the nodes built so far are not placed by the levels above, and out->stats.result
+// says which limit stopped it.
+bool parseInstanced(const Grammar& grammar, InstancedOut* out, std::string* outErr,
+	const ParseLimits& limits = ParseLimits());
+
+// Expand the instances of a node into cylinders in the local frame of the node,
+// appended to cylinders. The cylinders of the root node are the same model as
+// the one of parse(), but in a different order.
+void flatten(const InstancedOut& model, uint32_t node, std::vector<Cylinder>* cylinders);
+
+};
@@ -1,271 +1,1311 @@
 #include "lParser.hpp"
+#include "lGrammar.hpp"
+#include "lAnalysis.hpp"
+#include "lTurtle.hpp"
+#include "lRandom.hpp"
+#include "lThreadPool.hpp"
+#include "lSink.hpp"
 
-#include <map>
-#include <unordered_map>
-#include <memory>
-#include <cctype>
-#include <glm/gtx/quaternion.hpp>
-#include <stack>
-#include <cstdlib>
 #include <cmath>
+#include <cassert>
 #include <random>
+#include <chrono>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <functional>
 
-// Turtle definition
-struct Turtle {
-    glm::vec3 pos = glm::vec3(0);
-    glm::quat rotation = glm::quat(1.f, glm::vec3(0.f));
-    float thickness = 0.05f;
+using namespace lParser;
 
-    void advance(float t) {
-        pos += t * this->forward();
-    }
+// Frames reserved at the start of the parsing, more are only allocated
+// on really deep derivations
+static const uint32_t MAX_RESERVED_FRAMES = 1 << 16;
+// Same for the turtles and the output
+static const uint32_t MAX_RESERVED_TURTLES = 1 << 16;
+static const uint64_t MAX_RESERVED_CYLINDERS = 1 << 28;
+static const uint64_t MAX_RESERVED_MODULES = 1 << 28;
+// Brackets with fewer symbols are not worth a task of their own
+static const uint64_t MIN_TASK_SYMBOLS = 1 << 15;
+// Cylinders reserved for each task, from the bound of its symbols
+static const uint64_t MAX_RESERVED_TASK_CYLINDERS = 1 << 22;
+// Cylinders copied by each job when joining the output of the tasks
+static const size_t JOIN_CHUNK_TASKS = 16;
+// Modules rewritten by each job of a level step
+static const size_t LEVEL_CHUNK_MODULES = 1 << 16;
+// Modules interpreted by each job of a parallel interpretation
+static const size_t INTERPRET_CHUNK_MODULES = 1 << 16;
+// Derivations with fewer modules are stepped, or interpreted, without the pool
+static const size_t MIN_PARALLEL_MODULES = 1 << 18;
 
-    glm::vec3 forward() const
-    {
-        return glm::rotate(rotation, glm::vec3(0.f, 1.f, 0.f));
-    }
+// Pending range of ops of a rewritten symbol
+struct Frame {
+    uint32_t cursor, end;
+    uint32_t depth;
+    uint64_t key; // path of the rewriting, for RngMode::PathHashed
+};
+
+// Limits of a generation, and its consumption, shared by all its tasks
+struct Budget {
+    ParseLimits limits;
+    std::chrono::steady_clock::time_point start;
+    std::atomic<uint64_t> cylinders, bytes;
+    std::atomic<uint8_t> stop; // ParseResult that stopped the generation, or Ok
 
-    glm::vec3 left() const
+    Budget() : cylinders(0), bytes(0), stop((uint8_t)ParseResult::Ok) {}
+};
+
+const char* lParser::limitMessage(ParseResult result) {
+    switch (result)
     {
-        return glm::rotate(rotation, glm::vec3(-1.f, 0.f, 0.f));
+    case ParseResult::CylinderLimit: return "Too many cylinders";
+    case ParseResult::MemoryLimit: return "Too much memory";
+    case ParseResult::TimeLimit: return "Out of time";
+    case ParseResult::Cancelled: return "Cancelled";
+    default: return "Stopped";
     }
+}
 
-    glm::vec3 up() const
-    {
-        return glm::rotate(rotation, glm::vec3(0.f, 0.f, 1.f));
+ParseResult lParser::exceededLimit(const ParseLimits& limits, uint64_t cylinders, uint64_t bytes,
+    const std::chrono::steady_clock::time_point& start) {
+    if (limits.cancel != nullptr && limits.cancel->load(std::memory_order_relaxed)) {
+        return ParseResult::Cancelled;
+    }
+    if (cylinders > limits.maxCylinders) {
+        return ParseResult::CylinderLimit;
+    }
+    if (bytes > limits.maxBytes) {
+        return ParseResult::MemoryLimit;
     }
+    if (limits.maxSeconds > 0.0 &&
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() > limits.maxSeconds) {
+        return ParseResult::TimeLimit;
+    }
+    return ParseResult::Ok;
+}
 
-    void rotateArround(float angle, glm::vec3 axis)
-    {
-        //angle = std::fmod(angle, 
-        float sinA = std::sin(angle * 0.5f);
-        float cosA = std::cos(angle * 0.5f);
-        rotation = glm::quat(cosA, axis * sinA) * rotation;
+// Contents of a bracket, generated independently of the rest of the model.
+// Its cylinders go between the ones of its parent.
+struct Task {
+    Frame root;
+    Turtle turtle;
+    uint32_t baseFrames, baseTurtles; // stacks of the parent when it was created
+    std::vector<lParser::Cylinder> cylinders;
+    // Tasks created while generating, with the number of cylinders before them
+    std::vector<std::pair<size_t, Task*>> children;
+    lParser::ParseStats stats;
+    bool ok = true;
+    std::string error;
+    size_t total = 0, offset = 0; // cylinders with the children, and position in the output
+    uint64_t reportedBytes = 0;   // added to the budget, released when streamed to a sink
+    std::atomic<bool> done{ false }; // set when the task has finished, with its children created
+};
 
-        // normalize if needed
-        float dot = glm::dot(rotation, rotation);
-        if (std::abs(dot - 1.0f) > 1e-4) {
-            rotation = rotation / std::sqrt(dot);
-        }
-    }
+// Shared by all the tasks of a parallel generation
+struct ParallelData {
+    ThreadPool* pool;
+    Budget* budget;
+    std::mutex mutex;
+    std::deque<Task> tasks; // in creation order, parents before children
 };
 
 // Data used when parsing
 struct ParseData {
     Turtle turtle;
-    std::stack<Turtle> turtleStack;
-    uint32_t maxDepth;
-    float defaultAngle;
-    float thicknessReductionFactor;
+    std::vector<Turtle> turtleStack;
+    std::vector<Frame> frames;
     std::vector<lParser::Cylinder>* outCyls;
-
-    typedef struct StockVal {
-        float probability;
-        std::string rule;
-    } StockVal;
-    std::map<char, std::vector<StockVal>>* symbolMap;
-    std::unordered_map<std::string, float>* constantsMap;
+    CylinderSink* sink = nullptr; // outCyls is its batch, when there is one
+    const Grammar* grammar;
+    lParser::ParseStats* stats;
+    Budget* budget;
+    uint64_t reportedSymbols = 0, reportedCylinders = 0, reportedBytes = 0; // already added to the budget
+    // Symbols at which the limits are checked again. Some steps count more than one symbol,
+    // so the check does not wait for an exact multiple of LIMIT_CHECK_SYMBOLS.
+    uint64_t nextCheck = 0;
+    std::vector<uint32_t>* modules = nullptr; // only when deriving
 
     std::mt19937 rng;
     std::uniform_real_distribution<float> distr = std::uniform_real_distribution<float>(0.0, 1.0);
+
+    // Only on parallel generations
+    ParallelData* parallel = nullptr;
+    Task* task = nullptr;
+    uint32_t worker = 0;
 };
 
-// Check if the current variable holds some parameter. i.e. F(15).
-// It can be a number or a constant. If no parameter is found, return defaultValue.
-// The index i_ is the updated index on the axiom string.
-float checkIfCustomValue(const std::string& axiom, const ParseData* data, float defaultValue, size_t* i_,
-    bool* error, std::string* outErr) {
-    size_t i = *i_;
-    if (axiom.size() <= i + 1 || axiom[i + 1] != '(') {
-        return defaultValue;
-    }
-
-    // We know that at i+1 there is an (
-    size_t j = axiom.find(')', i + 2);
-    if (j == std::string::npos) {
-        *error |= true;
-        *outErr = "Can't find closing )";
-        return defaultValue;
-    }
-
-    float val;
-    // is constant or value?
-    if (std::isalpha(axiom[i + 2])) {
-        std::string id = axiom.substr(i + 2, j - (i + 2));
-        auto it = data->constantsMap->find(id);
-        if (it == data->constantsMap->end()) {
-            *error |= true;
-            *outErr = "Can't find constant " + id;
-            val = defaultValue;
+void runTask(Task* task, ParallelData* parallel, const Grammar* grammar, uint32_t worker);
+
+// Send the current batch to the sink
+bool flushBatch(ParseData* data, std::string* outErr) {
+    if (!data->sink->consume(data->outCyls->data(), data->outCyls->size(), outErr)) {
+        data->budget->stop = (uint8_t)ParseResult::SinkError;
+        return false;
+    }
+    data->outCyls->clear();
+    return true;
+}
+
+// Add the consumption since the last check to the budget, and check the limits.
+// Returns false if the generation has to stop, because of this task or of another one.
+bool checkBudget(ParseData* data, std::string* outErr) {
+    Budget& budget = *data->budget;
+    const ParseLimits& limits = budget.limits;
+    const uint64_t cylinders = data->stats->cylinders;
+    const uint64_t bytes = data->outCyls->capacity() * sizeof(Cylinder) + data->frames.capacity() * sizeof(Frame) +
+        data->turtleStack.capacity() * sizeof(Turtle) +
+        (data->modules != nullptr ? data->modules->capacity() * sizeof(uint32_t) : 0);
+    const uint64_t totalCylinders = budget.cylinders.fetch_add(cylinders - data->reportedCylinders) +
+        cylinders - data->reportedCylinders;
+    const uint64_t totalBytes = budget.bytes.fetch_add(bytes - data->reportedBytes) + bytes - data->reportedBytes;
+    if (limits.progress != nullptr) {
+        limits.progress->symbols.fetch_add(data->stats->symbols - data->reportedSymbols, std::memory_order_relaxed);
+        limits.progress->cylinders.fetch_add(cylinders - data->reportedCylinders, std::memory_order_relaxed);
+    }
+    data->reportedSymbols = data->stats->symbols;
+    data->nextCheck = data->stats->symbols + LIMIT_CHECK_SYMBOLS;
+    data->reportedCylinders = cylinders;
+    data->reportedBytes = bytes;
+
+    const ParseResult result = exceededLimit(limits, totalCylinders, totalBytes, budget.start);
+    // The first task that stops decides the result
+    uint8_t expected = (uint8_t)ParseResult::Ok;
+    if (result != ParseResult::Ok) {
+        budget.stop.compare_exchange_strong(expected, (uint8_t)result);
+    }
+    else {
+        expected = budget.stop.load();
+    }
+    if (expected != (uint8_t)ParseResult::Ok || result != ParseResult::Ok) {
+        *outErr = limitMessage(expected != (uint8_t)ParseResult::Ok ? (ParseResult)expected : result);
+        return false;
+    }
+    return true;
+}
+
+// Create a task for the contents of a bracket, if they are big enough.
+// Returns false if the bracket has to be generated by the current task.
+bool spawnBracket(const Op& op, const Frame& frame, ParseData* data) {
+    const Grammar& grammar = *data->grammar;
+    if (data->parallel == nullptr || op.param == NO_BRACKET) {
+        return false;
+    }
+    const uint32_t remaining = grammar.maxRecursionLevel - frame.depth;
+    const uint32_t level = std::min(remaining, grammar.costLevels - 1);
+    const uint64_t cost = grammar.bracketCosts[(size_t)level * grammar.brackets.size() + op.param];
+    if (cost < MIN_TASK_SYMBOLS) {
+        return false;
+    }
+
+    const Bracket& bracket = grammar.brackets[op.param];
+    Task* task;
+    {
+        std::lock_guard<std::mutex> lock(data->parallel->mutex);
+        data->parallel->tasks.emplace_back();
+        task = &data->parallel->tasks.back();
+    }
+    // The contents are part of the same rewriting, so they keep its depth and key
+    task->root = { bracket.push + 1, bracket.pop, frame.depth, frame.key };
+    task->turtle = data->turtle;
+    task->cylinders.reserve((size_t)std::min(cost, MAX_RESERVED_TASK_CYLINDERS));
+    task->baseFrames = data->task->baseFrames + (uint32_t)data->frames.size() - 1;
+    task->baseTurtles = data->task->baseTurtles + (uint32_t)data->turtleStack.size() + 1;
+    data->task->children.push_back({ data->outCyls->size(), task });
+
+    ParallelData* parallel = data->parallel;
+    data->parallel->pool->submit(data->worker, [task, parallel, &grammar](uint32_t worker) {
+        runTask(task, parallel, &grammar, worker);
+    });
+    return true;
+}
+
+// Run the turtle over an op
+inline bool interpretOp(const Op& op, ParseData* data, std::string* outErr) {
+    Turtle& turtle = data->turtle;
+    std::vector<Turtle>& turtleStack = data->turtleStack;
+    const Grammar& grammar = *data->grammar;
+    lParser::ParseStats& stats = *data->stats;
+    lParser::Cylinder cylinder;
+
+    switch (op.code)
+    {
+    case OpCode::Forward:
+        cylinder.width = turtle.thickness;
+        cylinder.init = turtle.pos;
+        turtle.advance(grammar.slots[op.param]);
+        cylinder.end = turtle.pos;
+        data->outCyls->push_back(cylinder);
+        stats.cylinders += 1;
+        if (data->sink != nullptr && data->outCyls->size() == SINK_BATCH_CYLINDERS && !flushBatch(data, outErr)) {
+            return false;
         }
-        else {
-            val = it->second;
+        break;
+    case OpCode::Push:
+        turtleStack.push_back(turtle);
+        stats.maxTurtles = std::max(stats.maxTurtles, (uint32_t)turtleStack.size());
+        break;
+    case OpCode::Pop:
+        if (turtleStack.empty()) {
+            *outErr = "Too many closing ] symbols";
+            return false;
         }
+        turtle = turtleStack.back();
+        turtleStack.pop_back();
+        break;
+    case OpCode::Shrink:
+        turtle.thickness /= grammar.slots[op.param];
+        break;
+    case OpCode::Grow:
+        turtle.thickness *= grammar.slots[op.param];
+        break;
+    case OpCode::Transform:
+        turtle.rotateLocal(grammar.transforms[op.param].rotation);
+        turtle.thickness *= grammar.transforms[op.param].thickness;
+        break;
+    case OpCode::Rotate: // always folded into transforms
+    case OpCode::Symbol:
+        break;
     }
-    else { // it is a value
-        val = std::strtof(axiom.c_str() + i + 2, nullptr);
+    return true;
+}
+
+// Run the turtle over a rewriting replaced by its subtree
+inline void interpretSubtree(const Subtree& subtree, ParseData* data) {
+    if (!subtree.identity) {
+        data->turtle.rotateLocal(subtree.rotation);
+        data->turtle.thickness *= subtree.thickness;
     }
-    
-    (*i_) = j;
-    return val;
+    data->stats->skippedSubtrees += 1;
 }
 
-// Process a single string axiom
-// This will be called recursively
-bool processRule(const std::string& axiom,
-    const uint32_t depth,
+// Index in Grammar::subtrees of the rewriting of a symbol at some depth, if it can be
+// replaced by its subtree. Otherwise returns NO_SUBTREE.
+static const uint32_t NO_SUBTREE = 0xFFFFFFFF;
+inline uint32_t skippedSubtree(const SymbolEntry& entry, uint32_t depth, const Grammar& grammar) {
+    const uint32_t remaining = grammar.maxRecursionLevel - depth - 1;
+    if (remaining >= grammar.analyzedLevels) {
+        return NO_SUBTREE;
+    }
+    const uint32_t index = remaining * grammar.ruleSymbolCount + entry.index;
+    return grammar.subtrees[index].skip ? index : NO_SUBTREE;
+}
+
+// Choose the mapping of a rewritten symbol
+inline const Successor& chooseSuccessor(const SymbolEntry& entry, uint64_t key, ParseData* data) {
+    const Grammar& grammar = *data->grammar;
+    const Successor* next = &grammar.successors[entry.first + entry.count - 1];
+    // If there is more than one, then we need to use rng to choose
+    if (entry.count > 1) {
+        // get random value and check
+        float val = grammar.rngMode == RngMode::PathHashed ? keyUniform(key) : data->distr(data->rng);
+        if (entry.count >= MIN_ALIAS_SUCCESSORS) {
+            const float scaled = val * (float)entry.count;
+            const uint32_t bucket = std::min((uint32_t)scaled, entry.count - 1);
+            const Alias& alias = grammar.aliases[entry.first + bucket];
+            return grammar.successors[entry.first + (scaled - (float)bucket < alias.threshold ? bucket : alias.alias)];
+        }
+        for (uint32_t j = 0; j < entry.count; ++j) {
+            const Successor& e = grammar.successors[entry.first + j];
+            if (e.probability >= val) {
+                next = &e;
+                break;
+            }
+        }
+    }
+    return *next;
+}
+
+// Process a range of compiled ops.
+// Rewritten symbols push a new frame instead of recursing, so the depth of the
+// derivation is only limited by the memory of the frame stack.
+bool processRule(const Frame& root,
     ParseData* data,
     std::string* outErr) {
-    Turtle& turtle = data->turtle;
-    lParser::Cylinder cylinder;
-    bool error = false;
-    float value;
-    // foreach of the characters in the mapping
-    for (size_t i = 0; i < axiom.size(); ++i) {
-        const char c = axiom[i];
+    std::vector<Frame>& frames = data->frames;
+    const Grammar& grammar = *data->grammar;
+    lParser::ParseStats& stats = *data->stats;
 
-        switch (c)
+    frames.push_back(root);
+    while (!frames.empty()) {
+        Frame& frame = frames.back();
+        if (frame.cursor == frame.end) {
+            frames.pop_back();
+            continue;
+        }
+        if (stats.symbols >= data->nextCheck && !checkBudget(data, outErr)) {
+            return false;
+        }
+        const uint32_t opIndex = frame.cursor++;
+        const Op& op = grammar.ops[opIndex];
+        const uint32_t depth = frame.depth;
+        const uint64_t key = frame.key;
+        stats.symbols += 1;
+
+        // The contents of the bracket leave the turtle as it is now, so they can
+        // be generated by another task, and this one continues after the ]
+        if (op.code == OpCode::Push && spawnBracket(op, frame, data)) {
+            frame.cursor = grammar.brackets[op.param].pop + 1;
+            stats.symbols += 1;
+        }
+        else if (!interpretOp(op, data, outErr)) {
+            return false;
+        }
+
+        // If the symbol has some mapping, continue with it
+        const SymbolEntry& entry = grammar.symbols[(uint8_t)op.symbol];
+        if (depth < entry.expandDepth) {
+            // Rewritings that do not draw anything are replaced by their net effect
+            const uint32_t subtree = skippedSubtree(entry, depth, grammar);
+            if (subtree != NO_SUBTREE) {
+                interpretSubtree(grammar.subtrees[subtree], data);
+                continue;
+            }
+
+            const uint64_t nextKey = childKey(key, opIndex);
+            const Successor& next = chooseSuccessor(entry, nextKey, data);
+            frames.push_back({ next.begin, next.end, depth + 1, nextKey });
+            stats.maxFrames = std::max(stats.maxFrames, (uint32_t)frames.size());
+        }
+    }
+
+    return true;
+}
+
+void runTask(Task* task, ParallelData* parallel, const Grammar* grammar, uint32_t worker) {
+    // Tasks that start after the generation has been stopped do nothing
+    const ParseResult stop = (ParseResult)parallel->budget->stop.load();
+    if (stop != ParseResult::Ok) {
+        task->ok = false;
+        task->error = limitMessage(stop);
+        task->done.store(true, std::memory_order_release);
+        return;
+    }
+
+    ParseData data;
+    data.turtle = task->turtle;
+    data.outCyls = &task->cylinders;
+    data.grammar = grammar;
+    data.stats = &task->stats;
+    data.budget = parallel->budget;
+    data.parallel = parallel;
+    data.task = task;
+    data.worker = worker;
+    task->ok = processRule(task->root, &data, &task->error);
+
+    task->stats.maxFrames += task->baseFrames;
+    task->stats.maxTurtles = std::max(task->stats.maxTurtles + task->baseTurtles, task->baseTurtles);
+    task->stats.stackBytes = data.frames.capacity() * sizeof(Frame) +
+        data.turtleStack.capacity() * sizeof(Turtle);
+    task->reportedBytes = data.reportedBytes;
+    task->done.store(true, std::memory_order_release);
+}
+
+// Send cylinders to a sink, in batches of up to SINK_BATCH_CYLINDERS
+bool sendCylinders(const Cylinder* cylinders, size_t count, CylinderSink* sink, std::string* outErr) {
+    for (size_t i = 0; i < count; i += SINK_BATCH_CYLINDERS) {
+        if (!sink->consume(cylinders + i, std::min(count - i, SINK_BATCH_CYLINDERS), outErr)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Send the cylinders of the tasks to a sink in the order of a sequential generation, while
+// the pool generates them. A task is sent once it has finished and everything before it has
+// been sent, and then its memory is released. Only the tasks finished ahead of their turn are
+// kept. While waiting for a task, this thread works as the worker 0 of the pool.
+bool streamTasks(Task* root, ThreadPool* pool, Budget* budget, CylinderSink* sink, std::string* outErr) {
+    struct Cursor {
+        Task* task;
+        size_t child, previous;
+    };
+    const auto waitTask = [pool](Task* task) {
+        pool->waitUntil([task]() { return task->done.load(std::memory_order_acquire); });
+    };
+    std::vector<Cursor> stack;
+    waitTask(root);
+    stack.push_back({ root, 0, 0 });
+    while (!stack.empty()) {
+        Cursor& cursor = stack.back();
+        Task* task = cursor.task;
+        const bool hasChild = cursor.child < task->children.size();
+        const size_t next = hasChild ? task->children[cursor.child].first : task->cylinders.size();
+        if (!sendCylinders(task->cylinders.data() + cursor.previous, next - cursor.previous, sink, outErr)) {
+            return false;
+        }
+        cursor.previous = next;
+        if (hasChild) {
+            Task* child = task->children[cursor.child++].second;
+            waitTask(child);
+            stack.push_back({ child, 0, 0 });
+        }
+        else {
+            std::vector<Cylinder>().swap(task->cylinders);
+            budget->bytes.fetch_sub(task->reportedBytes);
+            stack.pop_back();
+        }
+    }
+    return true;
+}
+
+// Generate the model with a pool of threads. The big brackets become tasks, and their
+// cylinders are joined at the end in the same order as a sequential generation, or sent
+// to the sink in that order while they are generated.
+bool parseParallel(const Grammar& grammar, std::vector<Cylinder>* accum, CylinderSink* sink,
+    Budget* budget, ParseStats* stats, std::string* outErr) {
+    ThreadPool pool(grammar.numThreads);
+    ParallelData parallel;
+    parallel.pool = &pool;
+    parallel.budget = budget;
+    parallel.tasks.emplace_back();
+    Task* root = &parallel.tasks.front();
+    root->root = { grammar.axiomBegin, grammar.axiomEnd, 0, rootKey(grammar.rngSeed) };
+    root->turtle.thickness = grammar.defaultThickness;
+    root->baseFrames = 0;
+    root->baseTurtles = 0;
+    pool.submit(0, [root, &parallel, &grammar](uint32_t worker) {
+        runTask(root, &parallel, &grammar, worker);
+    });
+    std::string sinkErr;
+    const bool streamed = sink == nullptr || streamTasks(root, &pool, budget, sink, &sinkErr);
+    if (!streamed) {
+        // Stop the tasks that are still running
+        budget->stop = (uint8_t)ParseResult::SinkError;
+    }
+    pool.wait();
+
+    std::deque<Task>& tasks = parallel.tasks;
+    stats->threads = pool.size();
+    stats->tasks = (uint32_t)tasks.size();
+    for (const Task& task : tasks) {
+        stats->symbols += task.stats.symbols;
+        stats->cylinders += task.stats.cylinders;
+        stats->skippedSubtrees += task.stats.skippedSubtrees;
+        stats->maxFrames = std::max(stats->maxFrames, task.stats.maxFrames);
+        stats->maxTurtles = std::max(stats->maxTurtles, task.stats.maxTurtles);
+        stats->stackBytes += task.stats.stackBytes;
+    }
+    // On errors, the cylinders generated until then are still joined
+    bool ret = true;
+    for (const Task& task : tasks) {
+        if (!task.ok) {
+            *outErr = task.error;
+            ret = false;
+            break;
+        }
+    }
+
+    if (sink != nullptr) {
+        if (!streamed) {
+            *outErr = sinkErr;
+            return false;
+        }
+        return ret;
+    }
+
+    // Children are always created after their parents, so the sizes are
+    // accumulated backwards, and the positions in the output forwards
+    for (auto it = tasks.rbegin(); it != tasks.rend(); ++it) {
+        it->total = it->cylinders.size();
+        for (const auto& child : it->children) {
+            it->total += child.second->total;
+        }
+    }
+    for (Task& task : tasks) {
+        size_t position = task.offset;
+        size_t previous = 0;
+        for (const auto& child : task.children) {
+            position += child.first - previous;
+            child.second->offset = position;
+            position += child.second->total;
+            previous = child.first;
+        }
+    }
+
+    const size_t first = accum->size();
+    accum->resize(first + root->total);
+    Cylinder* output = accum->data() + first;
+    pool.parallelFor(tasks.size(), JOIN_CHUNK_TASKS, [&tasks, output](size_t begin, size_t end) {
+        for (size_t t = begin; t < end; ++t) {
+            const Task& task = tasks[t];
+            size_t position = task.offset;
+            size_t previous = 0;
+            for (const auto& child : task.children) {
+                std::copy(task.cylinders.begin() + previous, task.cylinders.begin() + child.first,
+                    output + position);
+                position += child.first - previous + child.second->total;
+                previous = child.first;
+            }
+            std::copy(task.cylinders.begin() + previous, task.cylinders.end(), output + position);
+        }
+    });
+    return ret;
+}
+
+// A generation stopped by its limits still has a valid model, up to where it stopped
+bool stoppedByLimit(const Budget& budget) {
+    const ParseResult stop = (ParseResult)budget.stop.load();
+    return stop != ParseResult::Ok && stop != ParseResult::SinkError;
+}
+
+// Set up the data of a generation in a single thread, reserving the stacks with the bound
+// of the model, and the output with its size, or its expected size
+void setupSequential(const Grammar& grammar, uint64_t reservedCylinders, uint32_t maxStackDepth,
+    std::vector<Cylinder>* accum, CylinderSink* sink, Budget* budget, ParseStats* stats, ParseData* data) {
+    data->outCyls = accum;
+    data->sink = sink;
+    data->grammar = &grammar;
+    data->stats = stats;
+    data->budget = budget;
+    data->turtle.thickness = grammar.defaultThickness;
+    data->rng = std::mt19937(grammar.rngSeed); // set seed
+    // There can not be more frames than rewriting levels
+    data->frames.reserve(std::min(grammar.maxRecursionLevel + 1, MAX_RESERVED_FRAMES));
+    data->turtleStack.reserve(std::min(maxStackDepth, MAX_RESERVED_TURTLES));
+    if (sink == nullptr) {
+        const ParseLimits& limits = budget->limits;
+        const uint64_t reserved = std::min(std::min(reservedCylinders, limits.maxCylinders),
+            std::min(limits.maxBytes / sizeof(Cylinder) / 2, MAX_RESERVED_CYLINDERS));
+        accum->reserve(accum->size() + (size_t)reserved);
+    }
+}
+
+// End a generation in a single thread, sending the last batch to the sink
+bool endSequential(bool ret, ParseData* data, std::string* outErr) {
+    if (data->sink != nullptr && (ret || stoppedByLimit(*data->budget))) {
+        std::string sinkErr;
+        if (!flushBatch(data, &sinkErr)) {
+            *outErr = sinkErr;
+            ret = false;
+        }
+    }
+    data->stats->stackBytes = data->frames.capacity() * sizeof(Frame) +
+        data->turtleStack.capacity() * sizeof(Turtle);
+    return ret;
+}
+
+// Generate the model in a single thread
+bool parseSequential(const Grammar& grammar, const ParseEstimate& estimation, std::vector<Cylinder>* accum,
+    CylinderSink* sink, Budget* budget, ParseStats* stats, std::string* outErr) {
+    // The estimation gives the exact size of the output and of the turtle stack, or an upper
+    // bound of them for stochastic grammars. Their output is reserved with the expected size.
+    ParseData parseData;
+    setupSequential(grammar, estimation.reservedCylinders(), estimation.maxStackDepth,
+        accum, sink, budget, stats, &parseData);
+    const bool ret = processRule({ grammar.axiomBegin, grammar.axiomEnd, 0, rootKey(grammar.rngSeed) }, &parseData, outErr);
+    return endSequential(ret, &parseData, outErr);
+}
+
+// Rewrite the symbols like processRule, keeping the ops with effect on the turtle
+// instead of running it
+bool deriveRule(const Frame& root, ParseData* data, std::string* outErr) {
+    std::vector<Frame>& frames = data->frames;
+    std::vector<uint32_t>& modules = *data->modules;
+    const Grammar& grammar = *data->grammar;
+    lParser::ParseStats& stats = *data->stats;
+    uint32_t turtles = 0;
+
+    frames.push_back(root);
+    while (!frames.empty()) {
+        Frame& frame = frames.back();
+        if (frame.cursor == frame.end) {
+            frames.pop_back();
+            continue;
+        }
+        if (stats.symbols >= data->nextCheck && !checkBudget(data, outErr)) {
+            return false;
+        }
+        const uint32_t opIndex = frame.cursor++;
+        const Op& op = grammar.ops[opIndex];
+        const uint32_t depth = frame.depth;
+        const uint64_t key = frame.key;
+        stats.symbols += 1;
+
+        switch (op.code)
         {
-        case 'F':
-            cylinder.width = turtle.thickness;
-            cylinder.init = turtle.pos;
-            value = checkIfCustomValue(axiom, data, 1.0f, &i, &error, outErr);
-            turtle.advance(value);
-            cylinder.end = turtle.pos;
-            data->outCyls->push_back(cylinder);
+        case OpCode::Forward:
+            stats.cylinders += 1;
+            modules.push_back(opIndex);
             break;
-        case '+':
-            value = checkIfCustomValue(axiom, data, data->defaultAngle, &i, &error, outErr);
-            turtle.rotateArround(glm::radians(value), turtle.up());
+        case OpCode::Push:
+            turtles += 1;
+            stats.maxTurtles = std::max(stats.maxTurtles, turtles);
+            modules.push_back(opIndex);
             break;
-        case '-':
-            value = checkIfCustomValue(axiom, data, data->defaultAngle, &i, &error, outErr);
-            turtle.rotateArround(-glm::radians(value), turtle.up());
+        case OpCode::Pop:
+            if (turtles == 0) {
+                *outErr = "Too many closing ] symbols";
+                return false;
+            }
+            turtles -= 1;
+            modules.push_back(opIndex);
             break;
-        case '/':
-            value = checkIfCustomValue(axiom, data, data->defaultAngle, &i, &error, outErr);
-            turtle.rotateArround(glm::radians(value), turtle.forward());
+        case OpCode::Shrink:
+        case OpCode::Grow:
+        case OpCode::Transform:
+            modules.push_back(opIndex);
             break;
-        case '\\':
-            value = checkIfCustomValue(axiom, data, data->defaultAngle, &i, &error, outErr);
-            turtle.rotateArround(-glm::radians(value), turtle.forward());
+        case OpCode::Rotate:
+        case OpCode::Symbol:
             break;
-        case '&':
-            value = checkIfCustomValue(axiom, data, data->defaultAngle, &i, &error, outErr);
-            turtle.rotateArround(glm::radians(value), turtle.left());
+        }
+
+        const SymbolEntry& entry = grammar.symbols[(uint8_t)op.symbol];
+        if (depth < entry.expandDepth) {
+            // The subtree is kept instead of its transform, that depends on the parameters
+            const uint32_t subtree = skippedSubtree(entry, depth, grammar);
+            if (subtree != NO_SUBTREE) {
+                modules.push_back(SUBTREE_MODULE | subtree);
+                stats.skippedSubtrees += 1;
+                continue;
+            }
+
+            const uint64_t nextKey = childKey(key, opIndex);
+            const Successor& next = chooseSuccessor(entry, nextKey, data);
+            frames.push_back({ next.begin, next.end, depth + 1, nextKey });
+            stats.maxFrames = std::max(stats.maxFrames, (uint32_t)frames.size());
+        }
+    }
+
+    return true;
+}
+
+// Run the turtle over the modules of a derivation
+bool interpretModules(const uint32_t* begin, const uint32_t* end, ParseData* data, std::string* outErr) {
+    const Grammar& grammar = *data->grammar;
+    lParser::ParseStats& stats = *data->stats;
+
+    for (const uint32_t* it = begin; it != end; ++it) {
+        const uint32_t module = *it;
+        if (stats.symbols >= data->nextCheck && !checkBudget(data, outErr)) {
+            return false;
+        }
+        stats.symbols += 1;
+        if ((module & SUBTREE_MODULE) != 0) {
+            interpretSubtree(grammar.subtrees[module & ~SUBTREE_MODULE], data);
+        }
+        else if (!interpretOp(grammar.ops[module & MODULE_INDEX], data, outErr)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Part of a level, rewritten by one job of a level step
+struct LevelChunk {
+    size_t keys = 0;          // position of its first random key in DerivationLevels::frontierKeys
+    size_t offset = 0;        // position of its first module in the next level
+    size_t size = 0;          // modules written in the next level
+    size_t newKeys = 0;       // random keys written for the next level, and their position
+    size_t newKeysOffset = 0;
+    // Bracket depth of the written modules, relative to the start of the chunk
+    uint64_t cylinders = 0;
+    int64_t depth = 0, minDepth = 0, maxDepth = 0;
+};
+
+// Count the cylinders and the bracket depths of a range of modules
+void measureModules(const Grammar& grammar, const uint32_t* begin, const uint32_t* end, LevelChunk* chunk) {
+    for (const uint32_t* module = begin; module != end; ++module) {
+        switch (grammar.ops[*module & MODULE_INDEX].code)
+        {
+        case OpCode::Forward:
+            chunk->cylinders += 1;
             break;
-        case '^':
-            value = checkIfCustomValue(axiom, data, data->defaultAngle, &i, &error, outErr);
-            turtle.rotateArround(-glm::radians(value), turtle.left());
+        case OpCode::Push:
+            chunk->depth += 1;
+            chunk->maxDepth = std::max(chunk->maxDepth, chunk->depth);
             break;
-        case '|':
-            turtle.rotateArround(glm::pi<float>(), turtle.left());
+        case OpCode::Pop:
+            chunk->depth -= 1;
+            chunk->minDepth = std::min(chunk->minDepth, chunk->depth);
             break;
-        case '[':
-            data->turtleStack.push(data->turtle);
+        default:
             break;
-        case ']':
-            if (data->turtleStack.empty()) {
-                *outErr = "Too many closing ] symbols";
-                return false;
+        }
+    }
+}
+
+// Join the measures of the chunks of a level, in order
+bool measureLevel(const std::vector<LevelChunk>& chunks, Derivation* level, std::string* outErr) {
+    ParseStats& stats = level->stats;
+    int64_t turtles = 0;
+    for (const LevelChunk& chunk : chunks) {
+        if (turtles + chunk.minDepth < 0) {
+            *outErr = "Too many closing ] symbols";
+            return false;
+        }
+        stats.cylinders += chunk.cylinders;
+        stats.maxTurtles = std::max(stats.maxTurtles, (uint32_t)(turtles + chunk.maxDepth));
+        turtles += chunk.depth;
+    }
+    stats.symbols = level->modules.size();
+    return true;
+}
+
+// Add a module of the frontier of a level, with the random key of its rewriting
+void addFrontier(const Grammar& grammar, uint32_t opIndex, uint64_t key, Derivation* level,
+    std::vector<uint64_t>* frontierKeys) {
+    level->modules.push_back(opIndex | FRONTIER_MODULE);
+    if (grammar.stochastic && grammar.symbols[(uint8_t)grammar.ops[opIndex].symbol].count != 0) {
+        frontierKeys->push_back(key);
+    }
+}
+
+// Run fn(chunk) over the chunks, with the pool if there is one
+void forChunks(ThreadPool* pool, size_t count, const std::function<void(size_t)>& fn) {
+    if (pool == nullptr) {
+        for (size_t i = 0; i < count; ++i) {
+            fn(i);
+        }
+        return;
+    }
+    pool->parallelFor(count, 1, [&fn](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            fn(i);
+        }
+    });
+}
+
+// Derive the level after the last one of the levels. The modules are split in chunks,
+// that count the size of their rewriting, then an exclusive scan of the sizes gives the
+// position of each chunk in the next level, and the chunks write their successors there.
+// With a pool, each pass runs the chunks in parallel.
+bool stepLevel(const Grammar& grammar, DerivationLevels* levels, ThreadPool* pool, Budget* budget,
+    std::string* outErr) {
+    const std::vector<uint32_t>& modules = levels->levels.back().modules;
+    const uint32_t level = (uint32_t)levels->levels.size();
+    const bool keyed = grammar.stochastic;
+    const std::vector<uint64_t>& keys = levels->frontierKeys;
+    std::vector<LevelChunk> chunks((modules.size() + LEVEL_CHUNK_MODULES - 1) / LEVEL_CHUNK_MODULES);
+    const auto chunkBegin = [](size_t c) { return c * LEVEL_CHUNK_MODULES; };
+    const auto chunkEnd = [&modules](size_t c) { return std::min((c + 1) * LEVEL_CHUNK_MODULES, modules.size()); };
+    const auto rewritten = [&grammar](uint32_t module) {
+        return (module & FRONTIER_MODULE) != 0 &&
+            grammar.symbols[(uint8_t)grammar.ops[module & MODULE_INDEX].symbol].count != 0;
+    };
+
+    // The random keys of the rewritten modules are in order, so each chunk needs the
+    // position of its first one
+    if (keyed) {
+        forChunks(pool, chunks.size(), [&](size_t c) {
+            for (size_t i = chunkBegin(c); i < chunkEnd(c); ++i) {
+                chunks[c].newKeys += rewritten(modules[i]) ? 1 : 0;
+            }
+        });
+        size_t position = 0;
+        for (LevelChunk& chunk : chunks) {
+            chunk.keys = position;
+            position += chunk.newKeys;
+            chunk.newKeys = 0;
+        }
+    }
+
+    // Size of the rewriting of each chunk
+    forChunks(pool, chunks.size(), [&](size_t c) {
+        LevelChunk& chunk = chunks[c];
+        ParseData data;
+        data.grammar = &grammar;
+        size_t key = chunk.keys;
+        for (size_t i = chunkBegin(c); i < chunkEnd(c); ++i) {
+            const uint32_t module = modules[i];
+            chunk.size += 1;
+            if (!rewritten(module)) {
+                continue;
+            }
+            const uint32_t opIndex = module & MODULE_INDEX;
+            const Successor& next = chooseSuccessor(grammar.symbols[(uint8_t)grammar.ops[opIndex].symbol],
+                keyed ? childKey(keys[key++], opIndex) : 0, &data);
+            chunk.size += next.end - next.begin;
+            if (keyed) {
+                for (uint32_t j = next.begin; j < next.end; ++j) {
+                    chunk.newKeys += grammar.symbols[(uint8_t)grammar.ops[j].symbol].count != 0 ? 1 : 0;
+                }
+            }
+        }
+    });
+    size_t size = 0, newKeys = 0;
+    for (LevelChunk& chunk : chunks) {
+        chunk.offset = size;
+        chunk.newKeysOffset = newKeys;
+        size += chunk.size;
+        newKeys += chunk.newKeys;
+    }
+    const uint64_t bytes = (uint64_t)size * sizeof(uint32_t) + (uint64_t)newKeys * sizeof(uint64_t);
+    if (levels->bytes() + bytes > budget->limits.maxBytes) {
+        budget->stop = (uint8_t)ParseResult::MemoryLimit;
+        *outErr = limitMessage(ParseResult::MemoryLimit);
+        return false;
+    }
+    budget->bytes += bytes;
+
+    // Each chunk writes its successors at its position, and measures them
+    Derivation next;
+    std::vector<uint64_t> nextKeys(newKeys);
+    next.modules.resize(size);
+    forChunks(pool, chunks.size(), [&](size_t c) {
+        LevelChunk& chunk = chunks[c];
+        ParseStats stats;
+        std::vector<Cylinder> noCylinders;
+        ParseData data;
+        data.grammar = &grammar;
+        data.outCyls = &noCylinders;
+        data.stats = &stats;
+        data.budget = budget;
+        std::string chunkErr;
+        if (!checkBudget(&data, &chunkErr)) {
+            return;
+        }
+        uint32_t* out = next.modules.data() + chunk.offset;
+        uint64_t* outKeys = nextKeys.data() + chunk.newKeysOffset;
+        size_t key = chunk.keys;
+        for (size_t i = chunkBegin(c); i < chunkEnd(c); ++i) {
+            const uint32_t module = modules[i];
+            const uint32_t opIndex = module & MODULE_INDEX;
+            *out++ = opIndex;
+            if (!rewritten(module)) {
+                continue;
+            }
+            // The successor is the same as the one of a depth first derivation
+            const uint64_t nextKey = keyed ? childKey(keys[key++], opIndex) : 0;
+            const Successor& successor = chooseSuccessor(grammar.symbols[(uint8_t)grammar.ops[opIndex].symbol],
+                nextKey, &data);
+            for (uint32_t j = successor.begin; j < successor.end; ++j) {
+                *out++ = j | FRONTIER_MODULE;
+                if (keyed && grammar.symbols[(uint8_t)grammar.ops[j].symbol].count != 0) {
+                    *outKeys++ = nextKey;
+                }
+            }
+        }
+        measureModules(grammar, next.modules.data() + chunk.offset, out, &chunk);
+        stats.symbols = chunk.size;
+        checkBudget(&data, &chunkErr);
+    });
+    if (budget->stop.load() != (uint8_t)ParseResult::Ok) {
+        *outErr = limitMessage((ParseResult)budget->stop.load());
+        return false;
+    }
+
+    if (!measureLevel(chunks, &next, outErr)) {
+        return false;
+    }
+    next.stats.maxFrames = level + 1;
+    next.key = derivationKey(grammar, level);
+    levels->levels.push_back(std::move(next));
+    levels->frontierKeys.swap(nextKeys);
+    return true;
+}
+
+// Part of a derivation interpreted by one job. Its net effect is relative to the turtle at
+// its start, or to the turtle restored by its last ] that closes a bracket opened before it.
+struct InterpretChunk {
+    uint32_t pops = 0;           // ] that close brackets opened before the chunk
+    Turtle turtle;               // relative turtle at the end of the chunk
+    std::vector<Turtle> pushed;  // relative turtles pushed and not popped in the chunk
+    uint64_t cylinders = 0;
+    // Turtle at the start of the chunk, and the turtles restored by its pops
+    Turtle start;
+    std::vector<Turtle> restored;
+    std::vector<Cylinder> output;
+    ParseStats stats;
+    bool ok = true;
+    std::string error;
+};
+
+// Turtle that results of running from base the ops that took the identity turtle to relative
+Turtle composeTurtle(const Turtle& base, const Turtle& relative) {
+    Turtle turtle;
+    turtle.pos = base.pos + glm::rotate(base.rotation, relative.pos);
+    turtle.rotation = glm::normalize(base.rotation * relative.rotation);
+    turtle.thickness = base.thickness * relative.thickness;
+    return turtle;
+}
+
+// Net effect of a chunk of modules on the turtle and on its stack
+void summarizeChunk(const Grammar& grammar, const uint32_t* begin, const uint32_t* end, InterpretChunk* chunk) {
+    Turtle identity;
+    identity.thickness = 1.0f;
+    Turtle& turtle = chunk->turtle;
+    turtle = identity;
+    for (const uint32_t* it = begin; it != end; ++it) {
+        if ((*it & SUBTREE_MODULE) != 0) {
+            const Subtree& subtree = grammar.subtrees[*it & ~SUBTREE_MODULE];
+            if (!subtree.identity) {
+                turtle.rotateLocal(subtree.rotation);
+                turtle.thickness *= subtree.thickness;
             }
-            data->turtle = data->turtleStack.top();
-            data->turtleStack.pop();
+            continue;
+        }
+        const Op& op = grammar.ops[*it & MODULE_INDEX];
+        switch (op.code)
+        {
+        case OpCode::Forward:
+            turtle.advance(grammar.slots[op.param]);
+            chunk->cylinders += 1;
             break;
-        case '<':
-            value = checkIfCustomValue(axiom, data, data->thicknessReductionFactor, &i, &error, outErr);
-            data->turtle.thickness /= value;
+        case OpCode::Push:
+            chunk->pushed.push_back(turtle);
             break;
-        case '>':
-            value = checkIfCustomValue(axiom, data, data->thicknessReductionFactor, &i, &error, outErr);
-            data->turtle.thickness *= value;
+        case OpCode::Pop:
+            // Later ops are relative to the restored turtle
+            if (chunk->pushed.empty()) {
+                chunk->pops += 1;
+                turtle = identity;
+            }
+            else {
+                turtle = chunk->pushed.back();
+                chunk->pushed.pop_back();
+            }
             break;
-        default:
+        case OpCode::Shrink:
+            turtle.thickness /= grammar.slots[op.param];
+            break;
+        case OpCode::Grow:
+            turtle.thickness *= grammar.slots[op.param];
+            break;
+        case OpCode::Transform:
+            turtle.rotateLocal(grammar.transforms[op.param].rotation);
+            turtle.thickness *= grammar.transforms[op.param].thickness;
+            break;
+        case OpCode::Rotate:
+        case OpCode::Symbol:
             break;
         }
+    }
+}
+
+// Interpret a derivation with a pool of threads. The net effect of each chunk of modules
+// is computed in parallel, then composed in order to get the turtle and the stack at the
+// start of every chunk, and then the chunks run the turtle in parallel, in groups that
+// are joined in order into the output.
+bool interpretParallel(const Grammar& grammar, const Derivation& derivation, std::vector<Cylinder>* accum,
+    CylinderSink* sink, Budget* budget, ParseStats* stats, std::string* outErr) {
+    const std::vector<uint32_t>& modules = derivation.modules;
+    const size_t count = (modules.size() + INTERPRET_CHUNK_MODULES - 1) / INTERPRET_CHUNK_MODULES;
+    std::vector<InterpretChunk> chunks(count);
+    const auto chunkBegin = [&modules](size_t c) { return modules.data() + c * INTERPRET_CHUNK_MODULES; };
+    const auto chunkEnd = [&modules](size_t c) {
+        return modules.data() + std::min((c + 1) * INTERPRET_CHUNK_MODULES, modules.size());
+    };
 
-        if (error) {
+    ThreadPool pool(grammar.numThreads);
+    forChunks(&pool, count, [&](size_t c) {
+        summarizeChunk(grammar, chunkBegin(c), chunkEnd(c), &chunks[c]);
+    });
+
+    Turtle turtle;
+    turtle.thickness = grammar.defaultThickness;
+    std::vector<Turtle> stack;
+    for (InterpretChunk& chunk : chunks) {
+        if (chunk.pops > stack.size()) {
+            *outErr = "Too many closing ] symbols";
             return false;
         }
+        chunk.start = turtle;
+        chunk.restored.assign(stack.end() - chunk.pops, stack.end());
+        const Turtle base = chunk.pops > 0 ? stack[stack.size() - chunk.pops] : turtle;
+        stack.resize(stack.size() - chunk.pops);
+        for (const Turtle& pushed : chunk.pushed) {
+            stack.push_back(composeTurtle(base, pushed));
+        }
+        turtle = composeTurtle(base, chunk.turtle);
+        std::vector<Turtle>().swap(chunk.pushed);
+    }
+
+    ParseData out;
+    setupSequential(grammar, derivation.stats.cylinders, 0, accum, sink, budget, stats, &out);
+    const size_t group = 2 * (size_t)pool.size();
+    bool ret = true;
+    for (size_t first = 0; first < count && ret; first += group) {
+        const size_t last = std::min(first + group, count);
+        forChunks(&pool, last - first, [&](size_t i) {
+            InterpretChunk& chunk = chunks[first + i];
+            ParseData data;
+            data.grammar = &grammar;
+            data.stats = &chunk.stats;
+            data.budget = budget;
+            data.outCyls = &chunk.output;
+            data.turtle = chunk.start;
+            data.turtleStack.swap(chunk.restored);
+            chunk.output.reserve((size_t)chunk.cylinders);
+            chunk.ok = interpretModules(chunkBegin(first + i), chunkEnd(first + i), &data, &chunk.error) &&
+                checkBudget(&data, &chunk.error);
+        });
 
-        // If the character is in some mapping, call recursivelly
-        if (std::isalpha(c) && depth < data->maxDepth) {
-            std::map<char, std::vector<ParseData::StockVal>>::const_iterator it = data->symbolMap->find(c);
-            if (it != data->symbolMap->end()) {
-                const std::string* nextAxiom = &it->second.back().rule;
-                // If there is more than one, then we need to use rng to choose
-                if (it->second.size() > 1) {
-                    // get random value and check
-                    float val = data->distr(data->rng);
-                    for (const ParseData::StockVal& e : it->second) {
-                        if (e.probability >= val) {
-                            nextAxiom = &e.rule;
-                            break;
-                        }
+        const size_t capacity = accum->capacity();
+        for (size_t c = first; c < last && ret; ++c) {
+            InterpretChunk& chunk = chunks[c];
+            stats->symbols += chunk.stats.symbols;
+            stats->cylinders += chunk.stats.cylinders;
+            stats->skippedSubtrees += chunk.stats.skippedSubtrees;
+            // The cylinders of a stopped chunk are kept, as in a sequential interpretation
+            if (sink == nullptr) {
+                accum->insert(accum->end(), chunk.output.begin(), chunk.output.end());
+            }
+            else {
+                const Cylinder* cylinder = chunk.output.data();
+                size_t left = chunk.output.size();
+                while (left > 0 && ret) {
+                    const size_t n = std::min(left, SINK_BATCH_CYLINDERS - accum->size());
+                    accum->insert(accum->end(), cylinder, cylinder + n);
+                    cylinder += n;
+                    left -= n;
+                    if (accum->size() == SINK_BATCH_CYLINDERS && !flushBatch(&out, outErr)) {
+                        ret = false;
                     }
                 }
-                // process mapping
-                bool ret = processRule(*nextAxiom, depth + 1, data, outErr);
-                if (!ret) return false;
+            }
+            std::vector<Cylinder>().swap(chunk.output);
+            if (ret && !chunk.ok) {
+                *outErr = chunk.error;
+                ret = false;
             }
         }
+        budget->bytes += (accum->capacity() - capacity) * sizeof(Cylinder);
     }
 
-    return true;
+    stats->maxTurtles = derivation.stats.maxTurtles;
+    stats->threads = pool.size();
+    stats->tasks = (uint32_t)count;
+    return endSequential(ret, &out, outErr);
 }
 
-bool lParser::parse(const LParserInfo& info, LParserOut* out, std::string* outErr)
-{
-    assert(out != nullptr && outErr != nullptr);
+// Run a generation with the limits. The model goes into accum, or in batches into the
+// sink if there is one, using accum as the buffer of the batch. reservedCylinders is the
+// size of the model, or the expected one, see ParseEstimate::reservedCylinders.
+// The estimation, when given, is made under the limits of the generation and gives the reserved cylinders
+bool runGeneration(const Grammar& grammar, ParseEstimate* estimation, uint64_t reservedCylinders,
+    std::vector<Cylinder>* accum, CylinderSink* sink, const ParseLimits& limits, ParseStats* stats,
+    std::string* outErr, const std::function<bool(Budget*)>& run) {
+    Budget budget;
+    budget.limits = limits;
+    budget.start = std::chrono::steady_clock::now();
 
-    std::vector<Cylinder>& accum = out->cylinders;
-    accum.clear();// erase previous output
-    
-    std::map<char, std::vector<ParseData::StockVal>> symbolMap;
-    // Store all rules
-    for (const Rule& rule : info.rules) {
-        if (rule.id.empty()) {
-            *outErr = "There is a rule without ID";
-            return false;
+    if (estimation != nullptr) {
+        if (estimate(grammar, estimation, limits)) {
+            reservedCylinders = estimation->reservedCylinders();
         }
-        if (!std::isalpha(rule.id.front())) {
-            *outErr = rule.id + " has not a char as an identifier";
-            return false;
+        else {
+            const bool cancelled = limits.cancel != nullptr && limits.cancel->load();
+            budget.stop = (uint8_t)(cancelled ? ParseResult::Cancelled : ParseResult::TimeLimit);
+            *outErr = limitMessage((ParseResult)budget.stop.load());
+            reservedCylinders = 0;
         }
+    }
 
-        decltype(symbolMap)::iterator it = symbolMap.find(rule.id.front());
-        // if not exists... insert new
-        if (it == symbolMap.end()) {
-            symbolMap.insert({ rule.id.front(), { {rule.probability, rule.mapping} } });
+    if (sink != nullptr && !sink->begin(reservedCylinders, outErr)) {
+        stats->result = ParseResult::SinkError;
+        return false;
+    }
+
+    bool ret = budget.stop == (uint8_t)ParseResult::Ok && run(&budget);
+    const ParseResult stop = (ParseResult)budget.stop.load();
+    stats->result = ret ? ParseResult::Ok : stop != ParseResult::Ok ? stop : ParseResult::GrammarError;
+    // The limits are checked from time to time, so the tasks can generate some more cylinders
+    if (sink == nullptr && stats->result == ParseResult::CylinderLimit && accum->size() > limits.maxCylinders) {
+        accum->resize((size_t)limits.maxCylinders);
+        stats->cylinders = accum->size();
+    }
+    if (sink != nullptr && (ret || stoppedByLimit(budget))) {
+        std::string sinkErr;
+        if (!sink->finish(&sinkErr)) {
+            stats->result = ParseResult::SinkError;
+            *outErr = sinkErr;
+            ret = false;
         }
-        else {
-            it->second.push_back({rule.probability + it->second.back().probability, rule.mapping});
+    }
+
+    if (limits.progress != nullptr) {
+        limits.progress->symbols = stats->symbols;
+        limits.progress->cylinders = stats->cylinders;
+    }
+    stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - budget.start).count();
+    return ret;
+}
+
+// Generate the model of the grammar
+bool generate(const Grammar& grammar, std::vector<Cylinder>* accum, CylinderSink* sink,
+    const ParseLimits& limits, ParseStats* stats, std::string* outErr) {
+    ParseEstimate estimation;
+    return runGeneration(grammar, &estimation, 0, accum, sink, limits, stats, outErr, [&](Budget* budget) {
+        // Brackets can only be split when no rewriting closes a bracket that it did not open,
+        // and when their random values do not depend on the symbols before them
+        if (grammar.numThreads > 1 && grammar.balancedRules &&
+            (!grammar.stochastic || grammar.rngMode == RngMode::PathHashed)) {
+            return parseParallel(grammar, accum, sink, budget, stats, outErr);
         }
+        return parseSequential(grammar, estimation, accum, sink, budget, stats, outErr);
+    });
+}
 
+// Generate the model of a derivation of the grammar
+bool generate(const Grammar& grammar, const Derivation& derivation, std::vector<Cylinder>* accum,
+    CylinderSink* sink, const ParseLimits& limits, ParseStats* stats, std::string* outErr) {
+    if (derivation.key != 0 && derivation.key != derivationKey(grammar)) {
+        *outErr = "The derivation is not of this grammar";
+        stats->result = ParseResult::GrammarError;
+        return false;
     }
+    return runGeneration(grammar, nullptr, derivation.stats.cylinders, accum, sink, limits, stats, outErr,
+        [&](Budget* budget) {
+        if (grammar.numThreads > 1 && derivation.modules.size() >= MIN_PARALLEL_MODULES) {
+            return interpretParallel(grammar, derivation, accum, sink, budget, stats, outErr);
+        }
+        ParseData parseData;
+        setupSequential(grammar, derivation.stats.cylinders, derivation.stats.maxTurtles,
+            accum, sink, budget, stats, &parseData);
+        const bool ret = interpretModules(derivation.modules.data(),
+            derivation.modules.data() + derivation.modules.size(), &parseData, outErr);
+        return endSequential(ret, &parseData, outErr);
+    });
+}
 
-    // fix probabilities and check correct distributions
-    for (auto& it : symbolMap) {
-        if (std::abs(it.second.back().probability - 1.0f) > 1e-2) {
-            *outErr = "Probabilites do not add up to 1";
+bool lParser::parse(const Grammar& grammar, LParserOut* out, std::string* outErr, const ParseLimits& limits)
+{
+    assert(out != nullptr && outErr != nullptr);
+
+    out->cylinders.clear();// erase previous output
+    out->stats = ParseStats();
+    return generate(grammar, &out->cylinders, nullptr, limits, &out->stats, outErr);
+}
+
+bool lParser::parse(const Grammar& grammar, CylinderSink* sink, ParseStats* stats, std::string* outErr,
+    const ParseLimits& limits)
+{
+    assert(sink != nullptr && stats != nullptr && outErr != nullptr);
+
+    *stats = ParseStats();
+    std::vector<Cylinder> batch;
+    batch.reserve(SINK_BATCH_CYLINDERS);
+    return generate(grammar, &batch, sink, limits, stats, outErr);
+}
+
+bool lParser::derive(const Grammar& grammar, Derivation* out, std::string* outErr, const ParseLimits& limits)
+{
+    assert(out != nullptr && outErr != nullptr);
+
+    out->key = 0;
+    out->modules.clear();
+    out->stats = ParseStats();
+    ParseEstimate estimation;
+    std::vector<Cylinder> noCylinders;
+    const bool ret = runGeneration(grammar, &estimation, 0, &noCylinders, nullptr, limits, &out->stats, outErr,
+        [&](Budget* budget) {
+        // The modules are fewer than the symbols of the derivation. Stochastic derivations
+        // reserve their expected size, as the bound can be far bigger.
+        out->modules.reserve((size_t)std::min(std::min(estimation.reservedSymbols(),
+            limits.maxBytes / sizeof(uint32_t) / 2), MAX_RESERVED_MODULES));
+        ParseData parseData;
+        setupSequential(grammar, 0, 0, &noCylinders, nullptr, budget, &out->stats, &parseData);
+        parseData.modules = &out->modules;
+        const bool ret = deriveRule({ grammar.axiomBegin, grammar.axiomEnd, 0, rootKey(grammar.rngSeed) },
+            &parseData, outErr);
+        return endSequential(ret, &parseData, outErr);
+    });
+    if (ret) {
+        out->key = derivationKey(grammar);
+    }
+    return ret;
+}
+
+bool lParser::deriveLevel(const Grammar& grammar, DerivationLevels* levels, const Derivation** out,
+    ParseStats* stats, std::string* outErr, const ParseLimits& limits)
+{
+    assert(levels != nullptr && out != nullptr && stats != nullptr && outErr != nullptr);
+
+    *out = nullptr;
+    *stats = ParseStats();
+    if (grammar.stochastic && grammar.rngMode != RngMode::PathHashed) {
+        *outErr = "Only deterministic grammars, or with the Path hashed RNG mode, are derived by levels";
+        stats->result = ParseResult::GrammarError;
+        return false;
+    }
+    const uint64_t key = derivationKey(grammar, 0);
+    if (levels->key != key) {
+        *levels = DerivationLevels();
+        levels->key = key;
+    }
+    const uint32_t level = grammar.maxRecursionLevel;
+    if (level < levels->levels.size()) {
+        *out = &levels->levels[level];
+        return true;
+    }
+
+    // The first level is the axiom
+    if (levels->levels.empty()) {
+        Derivation first;
+        for (uint32_t i = grammar.axiomBegin; i < grammar.axiomEnd; ++i) {
+            addFrontier(grammar, i, rootKey(grammar.rngSeed), &first, &levels->frontierKeys);
+        }
+        std::vector<LevelChunk> chunks(1);
+        measureModules(grammar, first.modules.data(), first.modules.data() + first.modules.size(), &chunks[0]);
+        if (!measureLevel(chunks, &first, outErr)) {
+            levels->frontierKeys.clear();
+            stats->result = ParseResult::GrammarError;
             return false;
         }
+        first.stats.maxFrames = 1;
+        first.key = derivationKey(grammar, 0);
+        levels->levels.push_back(std::move(first));
     }
 
-    // Store all constants
-    std::unordered_map<std::string, float> constantsMap;
-    for (const auto& c : info.constants) {
-        constantsMap.emplace(c.first, c.second);
+    std::unique_ptr<ThreadPool> pool;
+    std::vector<Cylinder> noCylinders;
+    const bool ret = runGeneration(grammar, nullptr, 0, &noCylinders, nullptr, limits, stats, outErr,
+        [&](Budget* budget) {
+        budget->bytes += levels->bytes();
+        while (levels->levels.size() <= level) {
+            if (!pool && grammar.numThreads > 1 && levels->levels.back().modules.size() >= MIN_PARALLEL_MODULES) {
+                pool.reset(new ThreadPool(grammar.numThreads));
+            }
+            if (!stepLevel(grammar, levels, pool.get(), budget, outErr)) {
+                return false;
+            }
+            stats->symbols += levels->levels.back().modules.size();
+        }
+        stats->cylinders = levels->levels.back().stats.cylinders;
+        stats->threads = pool ? pool->size() : 1;
+        return true;
+    });
+    if (!ret) {
+        return false;
     }
+    levels->levels.back().stats.seconds = stats->seconds;
+    *out = &levels->levels[level];
+    return true;
+}
 
-    ParseData parseData;
-    parseData.maxDepth = info.maxRecursionLevel;
-    parseData.outCyls = &out->cylinders;
-    parseData.symbolMap = &symbolMap;
-    parseData.defaultAngle = info.defaultAngle;
-    parseData.constantsMap = &constantsMap;
-    parseData.thicknessReductionFactor = info.thicknessReductionFactor;
-    parseData.turtle.thickness = info.defaultThickness;
-    parseData.rng = std::mt19937(info.rngSeed); // set seed
-    return processRule(info.axiom, 0, &parseData, outErr);
+bool lParser::interpret(const Grammar& grammar, const Derivation& derivation, LParserOut* out,
+    std::string* outErr, const ParseLimits& limits)
+{
+    assert(out != nullptr && outErr != nullptr);
+
+    out->cylinders.clear();
+    out->stats = ParseStats();
+    return generate(grammar, derivation, &out->cylinders, nullptr, limits, &out->stats, outErr);
+}
+
+bool lParser::interpret(const Grammar& grammar, const Derivation& derivation, CylinderSink* sink,
+    ParseStats* stats, std::string* outErr, const ParseLimits& limits)
+{
+    assert(sink != nullptr && stats != nullptr && outErr != nullptr);
+
+    *stats = ParseStats();
+    std::vector<Cylinder> batch;
+    batch.reserve(SINK_BATCH_CYLINDERS);
+    return generate(grammar, derivation, &batch, sink, limits, stats, outErr);
 }
+
+bool lParser::parse(const LParserInfo& info, LParserOut* out, std::string* outErr, const ParseLimits& limits)
+{
+    assert(out != nullptr && outErr != nullptr);
+
+    out->cylinders.clear();// erase previous output
+    out->stats = ParseStats();
+
+    Grammar grammar;
+    if (!compile(info, &grammar, outErr)) {
+        out->stats.result = ParseResult::GrammarError;
+        return false;
+    }
+    return parse(grammar, out, outErr, limits);
+}
\ No newline at end of file
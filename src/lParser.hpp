@@ -2,6 +2,10 @@
 
 #include <vector>
 #include <string>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <cstdint>
 #include <glm/glm.hpp>
 
 namespace lParser {
@@ -17,6 +21,12 @@ struct Rule {
 	Rule(const std::string& id, const std::string& map) : id(id), mapping(map) {}
 };
 
+// Generator of the random values of the stochastic rules
+enum class RngMode : uint8_t {
+	Sequential, // one std::mt19937, drawn in the order of the derivation
+	PathHashed  // stateless, keyed by the seed and the path in the derivation tree
+};
+
 // Input data for the parser
 struct LParserInfo
 {
@@ -28,6 +38,10 @@ struct LParserInfo
 	float defaultThickness = 0.05f;
 	float thicknessReductionFactor = 0.707f;
 	int32_t rngSeed = 15312;
+	RngMode rngMode = RngMode::Sequential;
+	// Threads of the generation. Only grammars whose rules close all their brackets,
+	// and that are deterministic or use RngMode::PathHashed, are generated in parallel.
+	uint32_t numThreads = 1;
 };
 
 // Cylinder type to store output data of the parser
@@ -35,12 +49,152 @@ struct Cylinder {
 	glm::vec3 init, end;
 	float width;
 };
+
+// Why a generation ended
+enum class ParseResult : uint8_t {
+	Ok,
+	GrammarError,   // the grammar can not be compiled or interpreted
+	CylinderLimit,  // the limits of ParseLimits
+	MemoryLimit,
+	TimeLimit,
+	Cancelled,
+	SinkError       // the sink did not accept the cylinders
+};
+
+// Error message of a generation stopped by a limit
+const char* limitMessage(ParseResult result);
+
+// Progress of a running generation, that can be read from other threads
+struct ParseProgress {
+	std::atomic<uint64_t> symbols{ 0 };
+	std::atomic<uint64_t> cylinders{ 0 };
+};
+
+// Budget of a generation. The limits are checked every few thousand symbols, and when
+// one of them is exceeded the generation stops, keeping the cylinders generated so far.
+struct ParseLimits {
+	uint64_t maxCylinders = std::numeric_limits<uint64_t>::max();
+	uint64_t maxBytes = std::numeric_limits<uint64_t>::max(); // generated cylinders and stacks
+	double maxSeconds = 0.0;                   // no limit if 0
+	const std::atomic<bool>* cancel = nullptr; // set to true from any thread to stop
+	ParseProgress* progress = nullptr;         // updated at each check of the limits
+};
+
+// Symbols interpreted between two checks of the limits
+static const uint64_t LIMIT_CHECK_SYMBOLS = 1 << 14;
+
+// Limit exceeded by a generation started at start, that holds the given cylinders and bytes, or Ok
+ParseResult exceededLimit(const ParseLimits& limits, uint64_t cylinders, uint64_t bytes,
+	const std::chrono::steady_clock::time_point& start);
+
+// Measures of the last generated model
+struct ParseStats {
+	ParseResult result = ParseResult::Ok;
+	uint64_t symbols = 0;     // number of interpreted symbols
+	uint64_t cylinders = 0;   // generated cylinders
+	uint64_t skippedSubtrees = 0; // rewritings replaced by their effect on the turtle
+	uint32_t maxFrames = 0;   // deepest rewriting level reached
+	uint32_t maxTurtles = 0;  // highest number of pushed turtles
+	size_t stackBytes = 0;    // memory used by the frame and turtle stacks
+	uint32_t threads = 1;     // threads used by the generation
+	uint32_t tasks = 1;       // brackets generated as independent tasks, and the axiom, or interpreted chunks
+	double seconds = 0.0;     // time spent on the generation
+
+	double nsPerSymbol() const { return symbols != 0 ? 1e9 * seconds / (double)symbols : 0.0; }
+};
+
 struct LParserOut {
 	std::vector<Cylinder> cylinders;
+	ParseStats stats;
 };
 
 // Main function of the project. Parse some information, creating a new model.
 // If returns false, an error has occurred, and string outErr contains an error message.
-bool parse(const LParserInfo& info, LParserOut* out, std::string* outErr);
+// When the generation is stopped by the limits, out keeps the cylinders generated
+// until then, and out->stats.result says which limit stopped it.
+bool parse(const LParserInfo& info, LParserOut* out, std::string* outErr, const ParseLimits& limits = ParseLimits());
+
+// Compiled rules, see lGrammar.hpp
+struct Grammar;
+
+// Same as above, with an already compiled grammar. Useful to generate again
+// a model after changing only some constants.
+bool parse(const Grammar& grammar, LParserOut* out, std::string* outErr, const ParseLimits& limits = ParseLimits());
+
+// Receiver of cylinders, see lSink.hpp
+class CylinderSink;
+
+// Same as above, sending the cylinders to a sink in batches while they are generated,
+// so the model does not need to fit in memory. A model stopped by the limits is
+// still finished in the sink.
+// With Grammar::numThreads > 1, the cylinders of each task are sent once all the ones
+// before it have been sent. The tasks that finish ahead of their turn are kept in memory
+// until then, so the memory used is not bounded by the batches.
+bool parse(const Grammar& grammar, CylinderSink* sink, ParseStats* stats, std::string* outErr,
+	const ParseLimits& limits = ParseLimits());
+
+// Modules that are a rewriting replaced by its subtree, see Grammar::subtrees
+static const uint32_t SUBTREE_MODULE = 0x80000000;
+// Modules of the deepest level of a DerivationLevels, interpreted as their op
+static const uint32_t FRONTIER_MODULE = 0x40000000;
+static const uint32_t MODULE_INDEX = 0x3FFFFFFF;
+
+// Rewriting stage of a generation: what the turtle interprets, in order.
+// It only depends on the structure of the grammar, so it can be interpreted again
+// after changing the angles, the thicknesses or the constants.
+struct Derivation {
+	uint64_t key = 0;              // derivationKey of the grammar, 0 if not complete
+	std::vector<uint32_t> modules; // op indices, or SUBTREE_MODULE with the index of a subtree
+	ParseStats stats;              // of the rewriting, with the cylinders and turtles of the model
+
+	size_t bytes() const { return modules.capacity() * sizeof(uint32_t); }
+};
+
+// Rewriting stage alone, without running the turtle. Symbols without effect on the
+// turtle are not kept. A derivation stopped by the limits keeps the modules derived
+// until then, and has key 0.
+bool derive(const Grammar& grammar, Derivation* out, std::string* outErr, const ParseLimits& limits = ParseLimits());
+
+// Interpretation stage alone: run the turtle over a derivation of the grammar, with the
+// current values of its parameters. Gives the same model as parse().
+// With Grammar::numThreads > 1, big derivations are interpreted in parallel chunks, each one
+// starting from a turtle composed from the net effect of the chunks before it. The rounding
+// is different from a sequential interpretation, so the ends of the cylinders can differ by
+// up to PARALLEL_INTERPRET_TOLERANCE times (1 + their distance to the origin), and their
+// widths by up to PARALLEL_INTERPRET_TOLERANCE times the width.
+static const float PARALLEL_INTERPRET_TOLERANCE = 1e-4f;
+bool interpret(const Grammar& grammar, const Derivation& derivation, LParserOut* out, std::string* outErr,
+	const ParseLimits& limits = ParseLimits());
+bool interpret(const Grammar& grammar, const Derivation& derivation, CylinderSink* sink, ParseStats* stats,
+	std::string* outErr, const ParseLimits& limits = ParseLimits());
+
+// Derivations of consecutive recursion levels of a grammar, materialized breadth first.
+// Level n+1 is derived from level n in one rewriting pass over its modules, so changing the
+// recursion level by one costs one pass, or nothing when the level is already kept.
+// The pass is split in chunks of modules, that run in parallel with Grammar::numThreads.
+// The levels have every op of the derivation, without replacing subtrees.
+struct DerivationLevels {
+	uint64_t key = 0;                   // derivationKey of the grammar at recursion level 0
+	std::vector<Derivation> levels;     // levels[n] is the derivation at recursion level n
+	// Random keys of the rewriting of the frontier modules with rules of the last level,
+	// in order. Only for stochastic grammars.
+	std::vector<uint64_t> frontierKeys;
+
+	size_t bytes() const {
+		size_t total = frontierKeys.capacity() * sizeof(uint64_t);
+		for (const Derivation& level : levels) {
+			total += level.bytes();
+		}
+		return total;
+	}
+};
+
+// Get the derivation of the grammar at its recursion level from the levels, deriving the
+// levels that are missing. Levels of another grammar are dropped. Only for grammars whose
+// random values do not depend on the order of the derivation: deterministic ones, or with
+// RngMode::PathHashed. The pointer is valid until the levels change. The stats are the
+// ones of the new levels.
+bool deriveLevel(const Grammar& grammar, DerivationLevels* levels, const Derivation** out, ParseStats* stats,
+	std::string* outErr, const ParseLimits& limits = ParseLimits());
 
 };
\ No newline at end of file
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+
+namespace lParser {
+
+// Stateless random numbers for the stochastic rules.
+// Each rewriting has a key that depends only on the seed and on its path in the
+// derivation tree, so any subtree gives the same result when generated alone.
+
+// SplitMix64 finalizer
+inline uint64_t mixBits(uint64_t x) {
+	x += 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
+
+// Key of the root of the derivation, the axiom
+inline uint64_t rootKey(int32_t seed) {
+	return mixBits((uint64_t)(uint32_t)seed);
+}
+
+// Key of the rewriting of the op at opIndex, inside the rewriting with key parent.
+// An op is interpreted only once inside each rewriting, so siblings never collide.
+inline uint64_t childKey(uint64_t parent, uint32_t opIndex) {
+	return mixBits(parent ^ mixBits((uint64_t)opIndex + 1));
+}
+
+// Uniform value in [0, 1) from a key, with the 24 bits of a float mantissa
+inline float keyUniform(uint64_t key) {
+	return (float)(mixBits(key) >> 40) * (1.0f / 16777216.0f);
+}
+
+};
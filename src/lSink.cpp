@@ -0,0 +1,230 @@
+#include "lSink.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <glm/geometric.hpp>
+
+using namespace lParser;
+
+static const char FILE_MAGIC[4] = { 'L', 'C', 'Y', 'L' };
+static const uint32_t FILE_VERSION = 1;
+// Position of the count in the header
+static const long FILE_COUNT_OFFSET = sizeof(FILE_MAGIC) + sizeof(uint32_t);
+// Reserved memory of the vector sink, bigger models grow as usual
+static const uint64_t MAX_RESERVED_SINK_CYLINDERS = 1 << 28;
+
+bool VectorSink::begin(uint64_t cylinders, std::string* /*outErr*/)
+{
+	mCylinders->reserve(mCylinders->size() + (size_t)std::min(cylinders, MAX_RESERVED_SINK_CYLINDERS));
+	return true;
+}
+
+bool VectorSink::consume(const Cylinder* cylinders, size_t count, std::string* /*outErr*/)
+{
+	mCylinders->insert(mCylinders->end(), cylinders, cylinders + count);
+	return true;
+}
+
+void CylinderChunks::append(const Cylinder* cylinders, size_t count)
+{
+	while (count > 0) {
+		// The last block is full, or there is none
+		if (mSize == (uint64_t)mChunks.size() * CHUNK_CYLINDERS) {
+			mChunks.emplace_back(new Cylinder[CHUNK_CYLINDERS]);
+		}
+		const size_t used = (size_t)(mSize % CHUNK_CYLINDERS);
+		const size_t n = std::min(count, CHUNK_CYLINDERS - used);
+		std::memcpy(mChunks.back().get() + used, cylinders, n * sizeof(Cylinder));
+		mSize += n;
+		cylinders += n;
+		count -= n;
+	}
+}
+
+void CylinderChunks::clear()
+{
+	mChunks.clear();
+	mSize = 0;
+}
+
+size_t CylinderChunks::chunkSize(size_t i) const
+{
+	return i + 1 < mChunks.size() ? CHUNK_CYLINDERS : (size_t)(mSize - (uint64_t)i * CHUNK_CYLINDERS);
+}
+
+bool ChunkSink::consume(const Cylinder* cylinders, size_t count, std::string* /*outErr*/)
+{
+	mChunks->append(cylinders, count);
+	return true;
+}
+
+FileSink::~FileSink()
+{
+	if (mFile != nullptr) {
+		std::fclose(mFile);
+	}
+}
+
+bool FileSink::begin(uint64_t /*cylinders*/, std::string* outErr)
+{
+	mFile = std::fopen(mPath.c_str(), "wb");
+	if (mFile == nullptr) {
+		*outErr = "Can't open file " + mPath;
+		return false;
+	}
+	mCount = 0;
+	// The count is written again at the end
+	if (std::fwrite(FILE_MAGIC, sizeof(FILE_MAGIC), 1, mFile) != 1 ||
+		std::fwrite(&FILE_VERSION, sizeof(FILE_VERSION), 1, mFile) != 1 ||
+		std::fwrite(&mCount, sizeof(mCount), 1, mFile) != 1) {
+		*outErr = "Can't write to file " + mPath;
+		return false;
+	}
+	return true;
+}
+
+bool FileSink::consume(const Cylinder* cylinders, size_t count, std::string* outErr)
+{
+	static_assert(sizeof(Cylinder) == 7 * sizeof(float), "Cylinders are written as they are in memory");
+	if (std::fwrite(cylinders, sizeof(Cylinder), count, mFile) != count) {
+		*outErr = "Can't write to file " + mPath;
+		return false;
+	}
+	mCount += count;
+	return true;
+}
+
+bool FileSink::finish(std::string* outErr)
+{
+	bool ok = std::fseek(mFile, FILE_COUNT_OFFSET, SEEK_SET) == 0 &&
+		std::fwrite(&mCount, sizeof(mCount), 1, mFile) == 1;
+	ok &= std::fclose(mFile) == 0;
+	mFile = nullptr;
+	if (!ok) {
+		*outErr = "Can't write to file " + mPath;
+	}
+	return ok;
+}
+
+// Grow last to cover next, if both have the same width and lie on the same line, touching or
+// overlapping. Returns false if next has to be kept apart.
+bool mergeCylinder(const Cylinder& next, Cylinder* last)
+{
+	if (std::abs(next.width - last->width) > MERGE_TOLERANCE * std::max(std::abs(last->width), std::abs(next.width))) {
+		return false;
+	}
+	const glm::vec3 axis = last->end - last->init;
+	const float length2 = glm::dot(axis, axis);
+	// Positions of the ends of next along the axis, 0 at init and 1 at end of last
+	const float t0 = glm::dot(next.init - last->init, axis) / length2;
+	const float t1 = glm::dot(next.end - last->init, axis) / length2;
+	const float tolerance2 = MERGE_TOLERANCE * MERGE_TOLERANCE * length2;
+	const glm::vec3 off0 = next.init - last->init - t0 * axis;
+	const glm::vec3 off1 = next.end - last->init - t1 * axis;
+	if (glm::dot(off0, off0) > tolerance2 || glm::dot(off1, off1) > tolerance2 ||
+		std::max(t0, t1) < -MERGE_TOLERANCE || std::min(t0, t1) > 1.0f + MERGE_TOLERANCE) {
+		return false;
+	}
+	// The cylinder is the same in both directions, the one of last is kept
+	const float low = std::min(t0, t1);
+	const float high = std::max(t0, t1);
+	if (low < 0.0f) {
+		last->init = t0 < t1 ? next.init : next.end;
+	}
+	if (high > 1.0f) {
+		last->end = t0 < t1 ? next.end : next.init;
+	}
+	return true;
+}
+
+bool MergeSink::begin(uint64_t cylinders, std::string* outErr)
+{
+	mHasLast = false;
+	mInputCount = 0;
+	mOutputCount = 0;
+	return mTarget->begin(cylinders, outErr);
+}
+
+bool MergeSink::consume(const Cylinder* cylinders, size_t count, std::string* outErr)
+{
+	mBatch.clear();
+	for (size_t i = 0; i < count; ++i) {
+		const Cylinder& c = cylinders[i];
+		if (c.init == c.end) {
+			continue;
+		}
+		if (mHasLast && mergeCylinder(c, &mLast)) {
+			continue;
+		}
+		if (mHasLast) {
+			mBatch.push_back(mLast);
+		}
+		mLast = c;
+		mHasLast = true;
+	}
+	mInputCount += count;
+	mOutputCount += mBatch.size();
+	return mBatch.empty() || mTarget->consume(mBatch.data(), mBatch.size(), outErr);
+}
+
+bool MergeSink::finish(std::string* outErr)
+{
+	if (mHasLast) {
+		mHasLast = false;
+		mOutputCount += 1;
+		if (!mTarget->consume(&mLast, 1, outErr)) {
+			return false;
+		}
+	}
+	return mTarget->finish(outErr);
+}
+
+bool lParser::writeCylinderFile(const std::string& path, const CylinderChunks& chunks, std::string* outErr)
+{
+	FileSink sink(path);
+	if (!sink.begin(chunks.size(), outErr)) {
+		return false;
+	}
+	for (size_t i = 0; i < chunks.chunkCount(); ++i) {
+		if (!sink.consume(chunks.chunk(i), chunks.chunkSize(i), outErr)) {
+			return false;
+		}
+	}
+	return sink.finish(outErr);
+}
+
+bool lParser::readCylinderFile(const std::string& path, std::vector<Cylinder>* cylinders, std::string* outErr)
+{
+	std::FILE* file = std::fopen(path.c_str(), "rb");
+	if (file == nullptr) {
+		*outErr = "Can't open file " + path;
+		return false;
+	}
+	char magic[sizeof(FILE_MAGIC)];
+	uint32_t version = 0;
+	uint64_t count = 0;
+	bool ok = std::fread(magic, sizeof(magic), 1, file) == 1 &&
+		std::memcmp(magic, FILE_MAGIC, sizeof(magic)) == 0 &&
+		std::fread(&version, sizeof(version), 1, file) == 1 && version == FILE_VERSION &&
+		std::fread(&count, sizeof(count), 1, file) == 1;
+	// The count is checked against the size of the file before the cylinders are allocated
+	const long header = ok ? std::ftell(file) : -1;
+	ok = header >= 0 && std::fseek(file, 0, SEEK_END) == 0;
+	const long size = ok ? std::ftell(file) : -1;
+	ok = ok && size >= header && std::fseek(file, header, SEEK_SET) == 0 &&
+		count <= (uint64_t)(size - header) / sizeof(Cylinder);
+	if (ok) {
+		const size_t first = cylinders->size();
+		cylinders->resize(first + (size_t)count);
+		ok = std::fread(cylinders->data() + first, sizeof(Cylinder), (size_t)count, file) == count;
+		if (!ok) {
+			cylinders->resize(first);
+		}
+	}
+	std::fclose(file);
+	if (!ok) {
+		*outErr = path + " is not a valid cylinder file";
+	}
+	return ok;
+}
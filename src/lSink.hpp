@@ -0,0 +1,135 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include "lParser.hpp"
+
+namespace lParser {
+
+// Cylinders sent at once to a sink, the last batch can be smaller
+static const size_t SINK_BATCH_CYLINDERS = 1 << 16;
+
+// Receiver of the cylinders of a model, while it is generated.
+// The batches arrive in the same order as the cylinders of parse().
+// All the functions return false to stop the generation, with an error message in outErr.
+class CylinderSink {
+public:
+	virtual ~CylinderSink() = default;
+
+	// Called before the first batch, with the cylinders of the model to reserve memory for.
+	// The count is exact for deterministic grammars, and the expected one with some
+	// headroom for stochastic ones, which can generate more.
+	virtual bool begin(uint64_t /*cylinders*/, std::string* /*outErr*/) { return true; }
+	virtual bool consume(const Cylinder* cylinders, size_t count, std::string* outErr) = 0;
+	// Called after the last batch, only if the model has been generated without errors
+	// or it has been stopped by the limits
+	virtual bool finish(std::string* /*outErr*/) { return true; }
+};
+
+// Append the cylinders to a vector
+class VectorSink : public CylinderSink {
+public:
+	explicit VectorSink(std::vector<Cylinder>* cylinders) : mCylinders(cylinders) {}
+
+	bool begin(uint64_t cylinders, std::string* outErr) override;
+	bool consume(const Cylinder* cylinders, size_t count, std::string* outErr) override;
+
+private:
+	std::vector<Cylinder>* mCylinders;
+};
+
+// Write the cylinders to a binary file: the magic "LCYL", a uint32 version, a uint64 count
+// of cylinders, and the cylinders as 7 floats each (init, end and width).
+class FileSink : public CylinderSink {
+public:
+	explicit FileSink(const std::string& path) : mPath(path) {}
+	~FileSink();
+
+	bool begin(uint64_t cylinders, std::string* outErr) override;
+	bool consume(const Cylinder* cylinders, size_t count, std::string* outErr) override;
+	bool finish(std::string* outErr) override;
+
+	uint64_t getCount() const { return mCount; }
+
+private:
+	std::string mPath;
+	std::FILE* mFile = nullptr;
+	uint64_t mCount = 0;
+};
+
+// Cylinders of each block of a CylinderChunks
+static const size_t CHUNK_CYLINDERS = 1 << 20;
+
+// Cylinders stored in blocks of CHUNK_CYLINDERS, which are never moved once allocated.
+// Adding cylinders never copies the ones already stored, so a huge model does not need
+// twice its memory while it grows, and the blocks can be consumed one after another.
+class CylinderChunks {
+public:
+	void append(const Cylinder* cylinders, size_t count);
+	// Free all the blocks
+	void clear();
+
+	uint64_t size() const { return mSize; }
+	size_t chunkCount() const { return mChunks.size(); }
+	// Cylinders of a block, all the blocks are full but the last one
+	const Cylinder* chunk(size_t i) const { return mChunks[i].get(); }
+	size_t chunkSize(size_t i) const;
+	size_t bytes() const { return mChunks.size() * CHUNK_CYLINDERS * sizeof(Cylinder); }
+
+private:
+	std::vector<std::unique_ptr<Cylinder[]>> mChunks;
+	uint64_t mSize = 0;
+};
+
+// Append the cylinders to a CylinderChunks
+class ChunkSink : public CylinderSink {
+public:
+	explicit ChunkSink(CylinderChunks* chunks) : mChunks(chunks) {}
+
+	bool consume(const Cylinder* cylinders, size_t count, std::string* outErr) override;
+
+private:
+	CylinderChunks* mChunks;
+};
+
+// Relative error allowed when merging cylinders, for the distances to the axis (relative to
+// its length) and for the widths
+static const float MERGE_TOLERANCE = 1e-5f;
+
+// Merge consecutive cylinders of the same width that lie on the same line and touch or overlap,
+// such as the ones of a run of F without rotations, and drop the repeated ones and the ones of
+// length 0. The model looks the same with fewer cylinders, which are passed to another sink.
+// Cylinders that are not consecutive are not compared.
+class MergeSink : public CylinderSink {
+public:
+	explicit MergeSink(CylinderSink* target) : mTarget(target) {}
+
+	bool begin(uint64_t cylinders, std::string* outErr) override;
+	bool consume(const Cylinder* cylinders, size_t count, std::string* outErr) override;
+	// Passes the last merged cylinder, which is held until then
+	bool finish(std::string* outErr) override;
+
+	uint64_t getInputCount() const { return mInputCount; }
+	uint64_t getOutputCount() const { return mOutputCount; }
+	// Cylinders received for each one passed on, 1 when nothing is merged
+	double getReduction() const { return mOutputCount == 0 ? 1.0 : (double)mInputCount / mOutputCount; }
+
+private:
+	CylinderSink* mTarget;
+	Cylinder mLast;  // merged until now, not passed yet
+	bool mHasLast = false;
+	std::vector<Cylinder> mBatch;
+	uint64_t mInputCount = 0;
+	uint64_t mOutputCount = 0;
+};
+
+// Write the cylinders to a file as a FileSink, block by block
+bool writeCylinderFile(const std::string& path, const CylinderChunks& chunks, std::string* outErr);
+
+// Read a file written by a FileSink
+bool readCylinderFile(const std::string& path, std::vector<Cylinder>* cylinders, std::string* outErr);
+
+};
@@ -0,0 +1,174 @@
+#include "lSkeleton.hpp"
+#include "lGrammar.hpp"
+#include "lTurtle.hpp"
+
+#include <chrono>
+#include <cassert>
+#include <algorithm>
+
+using namespace lParser;
+
+// Turtle with the node where it is
+struct SkeletonTurtle {
+    Turtle turtle;
+    uint32_t node;
+};
+
+// Limit exceeded by a skeleton, or Ok
+static ParseResult skeletonLimit(const SkeletonOut& out, const ParseLimits& limits,
+    const std::chrono::steady_clock::time_point& start) {
+    if (limits.progress != nullptr) {
+        limits.progress->symbols = out.stats.symbols;
+        limits.progress->cylinders = out.parents.size();
+    }
+    return exceededLimit(limits, out.parents.size(),
+        out.nodes.capacity() * sizeof(SkeletonNode) + out.parents.capacity() * sizeof(uint32_t), start);
+}
+
+// The limits are checked from time to time, so a skeleton stopped by the limit of
+// cylinders can have some more segments
+static void trimSkeleton(const ParseLimits& limits, SkeletonOut* out) {
+    if (out->stats.result == ParseResult::CylinderLimit && out->parents.size() > limits.maxCylinders) {
+        out->parents.resize((size_t)limits.maxCylinders);
+        out->nodes.resize((size_t)limits.maxCylinders + 1);
+        out->stats.cylinders = out->parents.size();
+    }
+}
+
+bool lParser::buildSkeleton(const Grammar& grammar, const Derivation& derivation, SkeletonOut* out,
+    std::string* outErr, const ParseLimits& limits)
+{
+    assert(out != nullptr && outErr != nullptr);
+    *out = SkeletonOut();
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (derivation.key != 0 && derivation.key != derivationKey(grammar)) {
+        *outErr = "The derivation is not of this grammar";
+        out->stats.result = ParseResult::GrammarError;
+        return false;
+    }
+
+    // The derivation knows the size of the model, up to the limits
+    const uint64_t reserved = std::min(derivation.stats.cylinders, limits.maxCylinders);
+    out->nodes.reserve((size_t)std::min<uint64_t>(reserved + 1, limits.maxBytes / sizeof(SkeletonNode) / 2));
+    out->parents.reserve((size_t)std::min<uint64_t>(reserved, limits.maxBytes / sizeof(uint32_t) / 2));
+    SkeletonTurtle current;
+    current.turtle.thickness = grammar.defaultThickness;
+    current.node = 0;
+    out->nodes.push_back({ current.turtle.pos, current.turtle.thickness });
+    std::vector<SkeletonTurtle> stack;
+    stack.reserve(derivation.stats.maxTurtles);
+
+    uint64_t nextCheck = 0;
+    bool ret = true;
+    for (const uint32_t module : derivation.modules) {
+        if (out->stats.symbols >= nextCheck) {
+            nextCheck = out->stats.symbols + LIMIT_CHECK_SYMBOLS;
+            out->stats.result = skeletonLimit(*out, limits, start);
+            if (out->stats.result != ParseResult::Ok) {
+                ret = false;
+                break;
+            }
+        }
+        out->stats.symbols += 1;
+        Turtle& turtle = current.turtle;
+        if ((module & SUBTREE_MODULE) != 0) {
+            const Subtree& subtree = grammar.subtrees[module & ~SUBTREE_MODULE];
+            if (!subtree.identity) {
+                turtle.rotateLocal(subtree.rotation);
+                turtle.thickness *= subtree.thickness;
+            }
+            out->stats.skippedSubtrees += 1;
+            continue;
+        }
+        const Op& op = grammar.ops[module & MODULE_INDEX];
+        switch (op.code)
+        {
+        case OpCode::Forward:
+            turtle.advance(grammar.slots[op.param]);
+            out->parents.push_back(current.node);
+            current.node = (uint32_t)out->nodes.size();
+            out->nodes.push_back({ turtle.pos, turtle.thickness });
+            break;
+        case OpCode::Push:
+            stack.push_back(current);
+            out->stats.maxTurtles = std::max(out->stats.maxTurtles, (uint32_t)stack.size());
+            break;
+        case OpCode::Pop:
+            if (stack.empty()) {
+                *outErr = "Too many closing ] symbols";
+                out->stats.result = ParseResult::GrammarError;
+                ret = false;
+                break;
+            }
+            current = stack.back();
+            stack.pop_back();
+            break;
+        case OpCode::Shrink:
+            turtle.thickness /= grammar.slots[op.param];
+            break;
+        case OpCode::Grow:
+            turtle.thickness *= grammar.slots[op.param];
+            break;
+        case OpCode::Transform:
+            turtle.rotateLocal(grammar.transforms[op.param].rotation);
+            turtle.thickness *= grammar.transforms[op.param].thickness;
+            break;
+        case OpCode::Rotate: // always folded into transforms
+        case OpCode::Symbol:
+            break;
+        }
+        if (!ret) {
+            break;
+        }
+    }
+    if (!ret && out->stats.result != ParseResult::GrammarError) {
+        *outErr = limitMessage(out->stats.result);
+    }
+
+    out->stats.maxFrames = derivation.stats.maxFrames;
+    out->stats.stackBytes = stack.capacity() * sizeof(SkeletonTurtle);
+    out->stats.cylinders = out->parents.size();
+    trimSkeleton(limits, out);
+    out->stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (limits.progress != nullptr) {
+        limits.progress->symbols = out->stats.symbols;
+        limits.progress->cylinders = out->stats.cylinders;
+    }
+    return ret;
+}
+
+bool lParser::parseSkeleton(const Grammar& grammar, SkeletonOut* out, std::string* outErr, const ParseLimits& limits)
+{
+    assert(out != nullptr && outErr != nullptr);
+
+    Derivation derivation;
+    const bool derived = derive(grammar, &derivation, outErr, limits);
+    // A derivation stopped by a limit still gives a partial skeleton
+    const ParseResult stop = derivation.stats.result;
+    if (!derived && (stop == ParseResult::GrammarError || stop == ParseResult::Cancelled)) {
+        *out = SkeletonOut();
+        out->stats = derivation.stats;
+        return false;
+    }
+    if (!buildSkeleton(grammar, derivation, out, outErr, limits)) {
+        return false;
+    }
+    if (!derived) {
+        out->stats.result = stop;
+        trimSkeleton(limits, out);
+        return false;
+    }
+    return true;
+}
+
+void lParser::toCylinders(const SkeletonOut& skeleton, std::vector<Cylinder>* cylinders)
+{
+    assert(cylinders != nullptr);
+
+    cylinders->reserve(cylinders->size() + skeleton.parents.size());
+    for (size_t i = 0; i < skeleton.parents.size(); ++i) {
+        const SkeletonNode& child = skeleton.nodes[i + 1];
+        cylinders->push_back({ skeleton.nodes[skeleton.parents[i]].position, child.position, child.width });
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "lParser.hpp"
+
+namespace lParser {
+
+struct Grammar;
+
+// Point of the skeleton, shared by the segments that start and end at it
+struct SkeletonNode {
+	glm::vec3 position;
+	float width;  // thickness of the turtle when the segment that ends at the node was drawn
+};
+
+// Model as a tree of nodes. Each F adds a node at the end of its segment, and the segment
+// starts at the node where the turtle was, so branches share the node they start from.
+// Segment i is cylinder i of parse(), from node parents[i] to node i + 1, with the width of
+// node i + 1. Its end is given by its position, so only the start is stored.
+struct SkeletonOut {
+	std::vector<SkeletonNode> nodes;  // nodes[0] is the start of the turtle
+	std::vector<uint32_t> parents;    // node where each segment starts
+	ParseStats stats;
+
+	size_t segmentCount() const { return parents.size(); }
+	size_t bytes() const { return nodes.size() * sizeof(SkeletonNode) + parents.size() * sizeof(uint32_t); }
+};
+
+// Run the turtle over a derivation of the grammar, building the skeleton of the model.
+// When the generation is stopped by the limits, out keeps the skeleton built until then,
+// and out->stats.result says which limit stopped it.
+// If returns false, an error has occurred, and string outErr contains an error message.
+bool buildSkeleton(const Grammar& grammar, const Derivation& derivation, SkeletonOut* out, std::string* outErr,
+	const ParseLimits& limits = ParseLimits());
+
+// Same as above, deriving the grammar first
+bool parseSkeleton(const Grammar& grammar, SkeletonOut* out, std::string* outErr,
+	const ParseLimits& limits = ParseLimits());
+
+// Cylinders of the segments of a skeleton, appended to cylinders. They are the same
+// model as the one of parse().
+void toCylinders(const SkeletonOut& skeleton, std::vector<Cylinder>* cylinders);
+
+};
@@ -0,0 +1,134 @@
+#include "lThreadPool.hpp"
+
+#include <algorithm>
+
+using namespace lParser;
+
+ThreadPool::ThreadPool(uint32_t numThreads) : mPending(0), mQueued(0)
+{
+	numThreads = std::max(numThreads, 1u);
+	for (uint32_t i = 0; i < numThreads; ++i) {
+		mQueues.emplace_back(new Queue());
+	}
+	for (uint32_t i = 1; i < numThreads; ++i) {
+		mThreads.emplace_back(&ThreadPool::workerLoop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		mStopping = true;
+	}
+	mWakeUp.notify_all();
+	for (std::thread& thread : mThreads) {
+		thread.join();
+	}
+}
+
+void ThreadPool::submit(uint32_t worker, Job job)
+{
+	mPending.fetch_add(1);
+	{
+		Queue& queue = *mQueues[worker];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.jobs.push_back(std::move(job));
+	}
+	mQueued.fetch_add(1);
+	// Lock to not miss a worker that is going to sleep
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+	}
+	mWakeUp.notify_one();
+}
+
+bool ThreadPool::take(uint32_t worker, Job* job)
+{
+	if (mQueued.load() == 0) {
+		return false;
+	}
+	// Newest job of its own queue, the one with its data still in cache
+	{
+		Queue& queue = *mQueues[worker];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.jobs.empty()) {
+			*job = std::move(queue.jobs.back());
+			queue.jobs.pop_back();
+			mQueued.fetch_sub(1);
+			return true;
+		}
+	}
+	// Oldest job of the others, usually the biggest one
+	for (uint32_t i = 1; i < (uint32_t)mQueues.size(); ++i) {
+		Queue& queue = *mQueues[(worker + i) % mQueues.size()];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.jobs.empty()) {
+			*job = std::move(queue.jobs.front());
+			queue.jobs.pop_front();
+			mQueued.fetch_sub(1);
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::workerLoop(uint32_t worker)
+{
+	Job job;
+	while (true) {
+		if (take(worker, &job)) {
+			job(worker);
+			job = nullptr;
+			mPending.fetch_sub(1);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(mSleepMutex);
+		mWakeUp.wait(lock, [this]() { return mStopping || mQueued.load() != 0; });
+		if (mStopping) {
+			return;
+		}
+	}
+}
+
+void ThreadPool::wait()
+{
+	Job job;
+	while (mPending.load() != 0) {
+		if (take(0, &job)) {
+			job(0);
+			job = nullptr;
+			mPending.fetch_sub(1);
+		}
+		else {
+			std::this_thread::yield();
+		}
+	}
+}
+
+void ThreadPool::waitUntil(const std::function<bool()>& ready)
+{
+	Job job;
+	while (!ready()) {
+		if (take(0, &job)) {
+			job(0);
+			job = nullptr;
+			mPending.fetch_sub(1);
+		}
+		else {
+			std::this_thread::yield();
+		}
+	}
+}
+
+void ThreadPool::parallelFor(size_t count, size_t chunk, const std::function<void(size_t, size_t)>& fn)
+{
+	chunk = std::max(chunk, (size_t)1);
+	uint32_t worker = 0;
+	for (size_t begin = 0; begin < count; begin += chunk) {
+		const size_t end = std::min(begin + chunk, count);
+		submit(worker, [&fn, begin, end](uint32_t) { fn(begin, end); });
+		worker = (worker + 1) % size();
+	}
+	wait();
+}
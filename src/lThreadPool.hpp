@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+namespace lParser {
+
+// Pool of threads with one queue of jobs per worker.
+// A worker takes the newest job of its own queue, and when it is empty it steals
+// the oldest job of another queue. Jobs can submit more jobs while running.
+// The thread that creates the pool is the worker 0, and only works inside wait().
+class ThreadPool {
+public:
+	// The job receives the index of the worker that runs it
+	typedef std::function<void(uint32_t)> Job;
+
+	explicit ThreadPool(uint32_t numThreads);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	uint32_t size() const { return (uint32_t)mQueues.size(); }
+
+	// Add a job to the queue of a worker
+	void submit(uint32_t worker, Job job);
+
+	// Work until all the submitted jobs, and the jobs submitted by them, are finished
+	void wait();
+
+	// Work, as in wait(), until ready() returns true. Only from the thread that created the pool.
+	void waitUntil(const std::function<bool()>& ready);
+
+	// Call fn(begin, end) over chunks of [0, count), and wait for all of them
+	void parallelFor(size_t count, size_t chunk, const std::function<void(size_t, size_t)>& fn);
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Job> jobs;
+	};
+
+	std::vector<std::unique_ptr<Queue>> mQueues;
+	std::vector<std::thread> mThreads;
+	std::atomic<uint64_t> mPending;  // submitted jobs not finished yet
+	std::atomic<uint64_t> mQueued;   // jobs waiting in the queues
+	std::mutex mSleepMutex;
+	std::condition_variable mWakeUp;
+	bool mStopping = false;
+
+	bool take(uint32_t worker, Job* job);
+	void workerLoop(uint32_t worker);
+};
+
+};
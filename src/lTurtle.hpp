@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <glm/gtx/quaternion.hpp>
+
+namespace lParser {
+
+// Rotations applied to the turtle between two normalizations
+static const uint32_t TURTLE_NORMALIZE_PERIOD = 16;
+
+// Turtle definition
+// All the rotations of the turtle are around its own axes, so they are
+// right-multiplications by a constant quaternion, precomputed by the grammar.
+struct Turtle {
+	glm::vec3 pos = glm::vec3(0);
+	glm::quat rotation = glm::quat(1.f, glm::vec3(0.f));
+	float thickness = 0.05f;
+	uint32_t rotations = 0; // since the last normalization
+
+	void advance(float t) {
+		pos += t * this->forward();
+	}
+
+	glm::vec3 forward() const
+	{
+		return glm::rotate(rotation, glm::vec3(0.f, 1.f, 0.f));
+	}
+
+	// Rotate by a rotation expressed in the local frame of the turtle.
+	// A product of unit quaternions drifts slowly, so it is only normalized periodically.
+	void rotateLocal(const glm::quat& q)
+	{
+		rotation = rotation * q;
+		if (++rotations == TURTLE_NORMALIZE_PERIOD) {
+			rotation = glm::normalize(rotation);
+			rotations = 0;
+		}
+	}
+};
+
+};
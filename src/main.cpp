@@ -1,5 +1,8 @@
 #include <iostream>
 #include <stdio.h>
+#include <thread>
+#include <algorithm>
+#include <limits>
 
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
@@ -12,9 +15,29 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "lParser.hpp"
+#include "lGrammar.hpp"
+#include "lAnalysis.hpp"
+#include "lInstanced.hpp"
+#include "lSink.hpp"
 #include "Renderer.hpp"
 #include "Camera.hpp"
-
+#include "ParseWorker.hpp"
+
+
+// Models bigger than this ask for confirmation before being generated
+static const double WARN_CYLINDERS = 500000000.0;
+// Time given to the prediction of the size of a model in the UI thread
+static const double PREDICT_SECONDS = 0.05;
+// Chunks of a generation uploaded to the GPU in each frame, at most
+static const size_t UPLOAD_CHUNKS_PER_FRAME = 8;
+// Recursion levels predicted by the growth analysis
+static const uint32_t MAX_PREDICTED_DEPTH = 64;
+// Levels shown in the growth table after the current one
+static const uint32_t SHOWN_EXTRA_DEPTHS = 4;
+// Modes of Renderer::render
+static const uint32_t RENDER_MODES = 5;
+// Frames rendered with each mode to compare their times
+static const uint32_t COMPARED_FRAMES = 20;
 
 static void glfw_error_callback(int error, const char* description)
 {
@@ -126,12 +149,30 @@ void showHelpText() {
     ImGui::TextWrapped("Rules need to be stablished with a single letter identifier, and a mapping.");
     ImGui::TextWrapped("Also, all different rules with the same identifier need to have a probability "
         " that adds up to 1. This probability will be sampled from a uniform real distribution.");
+    ImGui::TextWrapped("With the Path hashed RNG mode, the random value of each rewriting depends only on the seed "
+        "and on its position in the derivation, so changing one branch does not change the others.");
     ImGui::TextWrapped("To change the rules and constants, you need to inspect the drop menu, and set the number of such elements to use.");
+    ImGui::TextWrapped("Once a model has been generated, changing the angle, the thicknesses or the value of a constant "
+        "shows the new model at once, without rewriting the symbols again. Changing the recursion level "
+        "of a deterministic grammar, or of one with the Path hashed RNG mode, only rewrites the new levels.");
+    ImGui::TextWrapped("The Growth section predicts the size, memory and time of the model at each recursion level, "
+        "and can choose the largest level whose model fits in the limits.");
+    ImGui::TextWrapped("The Skeleton output keeps each point of the model once, shared by the segments that start "
+        "and end at it, instead of one cylinder per segment.");
+    ImGui::TextWrapped("Merge collinear joins the consecutive cylinders of the same width that continue each other, "
+        "as in runs of F, and drops the repeated ones. The model looks the same with fewer cylinders.");
+    ImGui::TextWrapped("The Cylinder Mesh render modes draw the same cylinders as instances of a mesh, without a geometry "
+        "shader, with the number of sides of Ring segments. Compare render modes measures the time of a frame of each one.");
+    ImGui::TextWrapped("The Compact output stores each cylinder in 16 bytes, quantized relative to its chunk of the model, "
+        "and the GPU decodes it while drawing.");
 }
 
-void showParserInfo(lParser::LParserInfo* info) {
+// Returns true if a parameter that does not change the rules (angle, thickness, constant value
+// or recursion level) has changed
+bool showParserInfo(lParser::LParserInfo* info) {
     ImGui::PushID("showParseInfo");
     int32_t step = 1;
+    bool paramsChanged = false;
     if (ImGui::TreeNode("Constants")) {
         uint32_t size = (uint32_t)info->constants.size();
         ImGui::InputScalar("##nConstants", ImGuiDataType_U32, (void*)&size, &step, nullptr, "%d");
@@ -159,7 +200,7 @@ void showParserInfo(lParser::LParserInfo* info) {
                 ImGui::TableSetColumnIndex(0);
                 ImGui::InputText("##constId", &info->constants[i].first);
                 ImGui::TableNextColumn();
-                ImGui::InputFloat("##constDouble", &info->constants[i].second, 1.0);
+                paramsChanged |= ImGui::InputFloat("##constDouble", &info->constants[i].second, 1.0);
                 ImGui::PopID();
             }
 
@@ -169,12 +210,17 @@ void showParserInfo(lParser::LParserInfo* info) {
     }
 
     // recursion level
-    ImGui::InputScalar("Max Recursion", ImGuiDataType_U32, (void*)&info->maxRecursionLevel, &step, nullptr, "%d");
+    paramsChanged |= ImGui::InputScalar("Max Recursion", ImGuiDataType_U32, (void*)&info->maxRecursionLevel, &step, nullptr, "%d");
     // Default Angle
-    ImGui::InputFloat("Default Angle", &info->defaultAngle);
-    ImGui::InputFloat("Default Thickness", &info->defaultThickness);
-    ImGui::InputFloat("Thickness reduction factor", &info->thicknessReductionFactor);
+    paramsChanged |= ImGui::DragFloat("Default Angle", &info->defaultAngle, 0.1f);
+    paramsChanged |= ImGui::DragFloat("Default Thickness", &info->defaultThickness, 0.001f, 0.0f, FLT_MAX, "%.4f");
+    paramsChanged |= ImGui::DragFloat("Thickness reduction factor", &info->thicknessReductionFactor, 0.001f, 0.0f, FLT_MAX, "%.4f");
     ImGui::InputInt("RNG Seed", &info->rngSeed);
+    int rngMode = (int)info->rngMode;
+    if (ImGui::Combo("RNG Mode", &rngMode, "Sequential\0Path hashed\0")) {
+        info->rngMode = (lParser::RngMode)rngMode;
+    }
+    ImGui::InputScalar("Threads", ImGuiDataType_U32, (void*)&info->numThreads, &step, nullptr, "%d");
     ImGui::InputText("Axiom", &info->axiom);
 
     if (ImGui::TreeNode("Rules")) {
@@ -219,6 +265,45 @@ void showParserInfo(lParser::LParserInfo* info) {
     }
 
     ImGui::PopID();
+    return paramsChanged;
+}
+
+// Show the growth of the grammar, and the expected model at the levels around the current one
+void showGrowth(const lParser::GrowthAnalysis& growth, uint32_t currentDepth) {
+    ImGui::Text("Dominant eigenvalue %.4f", growth.dominantEigenvalue);
+    for (size_t i = 0; i < growth.symbols.size(); ++i) {
+        ImGui::Text("%c grows x%.3f per level", growth.symbols[i], growth.growthRates[i]);
+    }
+    const ImGuiTableFlags flags = ImGuiTableFlags_SizingStretchSame | ImGuiTableFlags_BordersOuter | ImGuiTableFlags_BordersV;
+    if (ImGui::BeginTable("TableGrowth", 4, flags)) {
+        ImGui::TableSetupColumn("Level");
+        ImGui::TableSetupColumn("Cylinders");
+        ImGui::TableSetupColumn("MB");
+        ImGui::TableSetupColumn("Seconds");
+        ImGui::TableHeadersRow();
+        const size_t shown = std::min(growth.depths.size(), (size_t)currentDepth + SHOWN_EXTRA_DEPTHS + 1);
+        for (size_t d = 0; d < shown; ++d) {
+            const lParser::DepthPrediction& prediction = growth.depths[d];
+            ImGui::TableNextRow();
+            ImGui::TableSetColumnIndex(0);
+            ImGui::Text("%zu%s", d, d == currentDepth ? " *" : "");
+            ImGui::TableSetColumnIndex(1);
+            ImGui::Text("%.3g", prediction.cylinders);
+            ImGui::TableSetColumnIndex(2);
+            ImGui::Text("%.3g", prediction.bytes / (1024.0 * 1024.0));
+            ImGui::TableSetColumnIndex(3);
+            ImGui::Text("%.3g", prediction.seconds);
+        }
+        ImGui::EndTable();
+    }
+}
+
+// Predict the size of the model without freezing the UI. Returns false if it took too long,
+// the size is unknown then.
+bool predictSize(const lParser::Grammar& grammar, lParser::ParseEstimate* estimation) {
+    lParser::ParseLimits limits;
+    limits.maxSeconds = PREDICT_SECONDS;
+    return lParser::estimate(grammar, estimation, limits);
 }
 
 void mainLoop(GLFWwindow* window) {
@@ -228,13 +313,50 @@ void mainLoop(GLFWwindow* window) {
     // bool show_demo_window = true;
     bool show_help_window = false;
     lParser::LParserInfo parserInfo;
-    lParser::LParserOut parserOut;
+    parserInfo.numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    lParser::ParseStats parseStats;
     std::string errorString;
     Renderer renderer;
     Camera camera;
     float scale = 1.0f;
     float cylinderWidthMultiplier = 1.0f;;
     uint32_t renderMode = 0;
+    int ringSegments = (int)Renderer::DEFAULT_RING_SEGMENTS;
+    // Milliseconds of a frame of each render mode, 0 until they are compared
+    double renderModeMs[RENDER_MODES] = {};
+    bool compareModes = false;
+    // Predicted size of the next generation, shared by its confirmation and its start
+    lParser::ParseEstimate estimation;
+    bool predicted = false;
+    lParser::Grammar grammar;
+    bool grammarCompiled = false;
+    // Deterministic models can be generated as instances of their repeated subtrees,
+    // and any model as a skeleton of shared nodes
+    int outputMode = (int)ParseWorker::Output::Cylinders;
+    lParser::InstancedOut instancedOut;
+    lParser::SkeletonOut skeletonOut;
+    lParser::CompactCylinders compactOut;
+    // Runs of collinear cylinders are merged while they are generated
+    bool mergeCylinders = false;
+    bool mergedModel = false;
+    uint64_t mergedCylinders = 0;
+    // Models are generated in the background, and the last one is rendered meanwhile
+    ParseWorker worker;
+    double expectedCylinders = 0.0; // of the running generation
+    bool reusedDerivation = false;
+    double deriveSeconds = 0.0;
+    size_t derivationBytes = 0;
+    // Exports are written in the background too, while the model is shown
+    ParseWorker exporter;
+    double exportExpectedCylinders = 0.0;
+    std::string exportPath = "model.cyl";
+    std::string exportStatus;
+    // Limits of the generation, 0 means no limit
+    float maxMillionCylinders = 0.0f;
+    float maxMegabytes = 0.0f;
+    float maxSeconds = 0.0f;
+    lParser::GrowthAnalysis growth;
+    bool hasGrowth = false;
     glEnable(GL_MULTISAMPLE);
 
     while (!glfwWindowShouldClose(window))
@@ -258,12 +380,110 @@ void mainLoop(GLFWwindow* window) {
                 show_help_window = true;
             }
             // Show parsing configuration
-            showParserInfo(&parserInfo);
+            const bool paramsChanged = showParserInfo(&parserInfo);
             ImGui::Separator();
             bool parse = false;
             if (ImGui::Button("Parse")) {
                 parse = true;
             }
+            ImGui::SameLine();
+            ImGui::SetNextItemWidth(120.0f);
+            ImGui::Combo("Output", &outputMode, "Cylinders\0Instanced\0Skeleton\0Compact\0");
+            const ParseWorker::Output output = (ParseWorker::Output)outputMode;
+            if (output == ParseWorker::Output::Cylinders || output == ParseWorker::Output::Compact) {
+                ImGui::SameLine();
+                ImGui::Checkbox("Merge collinear", &mergeCylinders);
+            }
+            // The generation stops when a limit is exceeded, keeping the model generated until then
+            if (ImGui::TreeNode("Limits")) {
+                ImGui::InputFloat("Max cylinders (M)", &maxMillionCylinders, 1.0f, 10.0f, "%.1f");
+                ImGui::InputFloat("Max memory (MB)", &maxMegabytes, 64.0f, 512.0f, "%.0f");
+                ImGui::InputFloat("Time limit (s)", &maxSeconds, 1.0f, 10.0f, "%.1f");
+                maxMillionCylinders = std::max(maxMillionCylinders, 0.0f);
+                maxMegabytes = std::max(maxMegabytes, 0.0f);
+                maxSeconds = std::max(maxSeconds, 0.0f);
+                ImGui::TreePop();
+            }
+            lParser::ParseLimits limits;
+            if (maxMillionCylinders > 0.0f) {
+                limits.maxCylinders = (uint64_t)(maxMillionCylinders * 1e6);
+            }
+            if (maxMegabytes > 0.0f) {
+                limits.maxBytes = (uint64_t)(maxMegabytes * 1024.0 * 1024.0);
+            }
+            limits.maxSeconds = maxSeconds;
+            // Expected size of the model at each recursion level, without generating it
+            bool analyze = false, fitDepth = false;
+            if (ImGui::TreeNode("Growth")) {
+                analyze = ImGui::Button("Analyze");
+                ImGui::SameLine();
+                fitDepth = ImGui::Button("Largest recursion under the limits");
+                if (hasGrowth) {
+                    showGrowth(growth, parserInfo.maxRecursionLevel);
+                }
+                ImGui::TreePop();
+            }
+            if (analyze || fitDepth) {
+                lParser::Grammar analyzed;
+                hasGrowth = lParser::compile(parserInfo, &analyzed, &errorString);
+                if (hasGrowth) {
+                    // The time is predicted with the speed of the last generation
+                    const double nsPerSymbol = parseStats.nsPerSymbol() > 0.0 ?
+                        parseStats.nsPerSymbol() : lParser::DEFAULT_NS_PER_SYMBOL;
+                    lParser::analyzeGrowth(analyzed, MAX_PREDICTED_DEPTH, nsPerSymbol, &growth);
+                }
+                else {
+                    ImGui::OpenPopup("Error PopUp");
+                }
+            }
+            // Without a limit of cylinders, the models that ask for confirmation are not chosen
+            if (fitDepth && hasGrowth) {
+                parserInfo.maxRecursionLevel = lParser::largestDepth(growth,
+                    maxMillionCylinders > 0.0f ? maxMillionCylinders * 1e6 : WARN_CYLINDERS,
+                    maxMegabytes > 0.0f ? maxMegabytes * 1024.0 * 1024.0 : std::numeric_limits<double>::infinity());
+            }
+            // Write the cylinders of the current grammar to a file, as they are generated
+            if (!exporter.isRunning()) {
+                ImGui::InputText("##exportPath", &exportPath);
+                ImGui::SameLine();
+                if (ImGui::Button("Export") && grammarCompiled) {
+                    lParser::ParseEstimate exportEstimation;
+                    exportExpectedCylinders = predictSize(grammar, &exportEstimation) ?
+                        exportEstimation.expectedCylinders : 0.0;
+                    exportStatus.clear();
+                    exporter.startExport(grammar, exportPath, limits, mergeCylinders);
+                }
+            }
+            else {
+                ParseWorker::Result exported;
+                if (exporter.takeResult(&exported)) {
+                    const lParser::ParseResult stop = exported.stats.result;
+                    if (exported.ok || (stop != lParser::ParseResult::GrammarError &&
+                        stop != lParser::ParseResult::SinkError)) {
+                        char status[128];
+                        snprintf(status, sizeof(status), "%s%llu cylinders written",
+                            exported.ok ? "" : "Stopped, ", (unsigned long long)exported.writtenCylinders);
+                        exportStatus = status;
+                    }
+                    if (!exported.ok && stop != lParser::ParseResult::Cancelled) {
+                        errorString = exported.error;
+                        ImGui::OpenPopup("Error PopUp");
+                    }
+                }
+                else {
+                    const uint64_t cylinders = exporter.getCylinders();
+                    char overlay[64];
+                    snprintf(overlay, sizeof(overlay), "Exporting, %llu cylinders", (unsigned long long)cylinders);
+                    ImGui::ProgressBar(exportExpectedCylinders > 0.0 ?
+                        (float)std::min(cylinders / exportExpectedCylinders, 1.0) : 0.0f, ImVec2(-1.0f, 0.0f), overlay);
+                    if (ImGui::Button("Cancel export")) {
+                        exporter.cancel();
+                    }
+                }
+            }
+            if (!exportStatus.empty()) {
+                ImGui::Text("%s", exportStatus.c_str());
+            }
             ImGui::Separator();
             // List of all the pre setup examples
             if (ImGui::TreeNode("Examples")) {
@@ -294,17 +514,145 @@ void mainLoop(GLFWwindow* window) {
                 ImGui::TreePop();
             }
 
-            // If button clicked, or example loaded... parse
+            // Before parsing, predict the size of the model, and ask if it is too big or unknown
+            bool generate = false;
             if (parse) {
-                bool ret = lParser::parse(parserInfo, &parserOut, &errorString);
+                grammarCompiled = lParser::compile(parserInfo, &grammar, &errorString);
+                predicted = grammarCompiled && predictSize(grammar, &estimation);
+                if (grammarCompiled && (!predicted || estimation.expectedCylinders > WARN_CYLINDERS)) {
+                    ImGui::OpenPopup("Big Model PopUp");
+                }
+                else {
+                    generate = true;
+                }
+            }
+            // Changes of the parameters are shown while they are edited, when the model can be
+            // interpreted again from the derivation, or the levels, kept by the worker
+            else if (paramsChanged && grammarCompiled && output != ParseWorker::Output::Instanced) {
+                const uint32_t previousLevel = grammar.maxRecursionLevel;
+                generate = lParser::updateParameters(parserInfo, &grammar) && worker.reusesDerivation(grammar);
+                if (generate) {
+                    predicted = predictSize(grammar, &estimation);
+                    if (grammar.maxRecursionLevel > previousLevel &&
+                        (!predicted || estimation.expectedCylinders > WARN_CYLINDERS)) {
+                        ImGui::OpenPopup("Big Model PopUp");
+                        generate = false;
+                    }
+                }
+            }
+            if (ImGui::BeginPopupModal("Big Model PopUp", nullptr, ImGuiWindowFlags_AlwaysAutoResize)) {
+                if (predicted) {
+                    ImGui::Text("The model will have %s%.0f cylinders (%.1f MB).",
+                        estimation.exact ? "" : "an expected number of ",
+                        estimation.expectedCylinders,
+                        estimation.expectedCylinders * sizeof(lParser::Cylinder) / (1024.0 * 1024.0));
+                }
+                else {
+                    ImGui::Text("The size of the model could not be predicted in %.2f s.", PREDICT_SECONDS);
+                }
+                ImGui::Text("Generate it anyway?");
+                if (ImGui::Button("Generate")) {
+                    generate = true;
+                    ImGui::CloseCurrentPopup();
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("Cancel")) {
+                    ImGui::CloseCurrentPopup();
+                }
+                ImGui::EndPopup();
+            }
+
+            // If button clicked, or example loaded... start generating in the background,
+            // replacing the generation that is running
+            if (generate && grammarCompiled) {
+                if (worker.isRunning()) {
+                    worker.stop();
+                    renderer.discardPrimitives();
+                }
+                // The prediction was made when the generation was asked for
+                expectedCylinders = predicted ? estimation.expectedCylinders : 0.0;
+                if (output == ParseWorker::Output::Cylinders) {
+                    renderer.beginPrimitives(predicted ? estimation.reservedCylinders() :
+                        std::numeric_limits<uint64_t>::max());
+                }
+                worker.start(grammar, output, limits, mergeCylinders);
+            }
+            else if (generate) {
                 // If returned error, open a new popup with it
-                if (!ret) {
-                    ImGui::OpenPopup("Error PopUp");
-                    //std::cerr << "Error when parsing: " << errorString << std::endl;
-                    //errorString.clear();
+                ImGui::OpenPopup("Error PopUp");
+            }
+
+            // Upload the chunks generated since the last frame, so the model fills in
+            if (worker.isRunning()) {
+                std::vector<std::vector<lParser::Cylinder>> chunks;
+                worker.takeChunks(UPLOAD_CHUNKS_PER_FRAME, &chunks);
+                for (const std::vector<lParser::Cylinder>& chunk : chunks) {
+                    renderer.appendPrimitives(chunk.data(), chunk.size());
                 }
 
-                renderer.setupPrimitivesToRender(parserOut.cylinders);
+                ParseWorker::Result result;
+                if (worker.takeResult(&result)) {
+                    const lParser::ParseResult stop = result.stats.result;
+                    // Models stopped by a limit are kept, the cancelled and wrong ones, and the
+                    // stopped instanced ones that have no model, leave the last model on screen
+                    const bool keep = (result.ok || result.output != ParseWorker::Output::Instanced) &&
+                        stop != lParser::ParseResult::Cancelled &&
+                        stop != lParser::ParseResult::GrammarError && stop != lParser::ParseResult::SinkError;
+                    if (result.output == ParseWorker::Output::Compact && keep) {
+                        instancedOut = lParser::InstancedOut();
+                        skeletonOut = lParser::SkeletonOut();
+                        compactOut = std::move(result.compact);
+                        renderer.setupCompactToRender(compactOut);
+                        parseStats = result.stats;
+                    }
+                    else if (result.output == ParseWorker::Output::Skeleton && keep) {
+                        instancedOut = lParser::InstancedOut();
+                        compactOut = lParser::CompactCylinders();
+                        skeletonOut = std::move(result.skeleton);
+                        renderer.setupSkeletonToRender(skeletonOut);
+                        parseStats = result.stats;
+                    }
+                    else if (!result.instanced.nodes.empty() && keep) {
+                        instancedOut = std::move(result.instanced);
+                        skeletonOut = lParser::SkeletonOut();
+                        compactOut = lParser::CompactCylinders();
+                        renderer.setupInstancesToRender(instancedOut);
+                        parseStats = result.stats;
+                    }
+                    else if (keep) {
+                        instancedOut = lParser::InstancedOut();
+                        skeletonOut = lParser::SkeletonOut();
+                        compactOut = lParser::CompactCylinders();
+                        renderer.endPrimitives();
+                        parseStats = result.stats;
+                    }
+                    else {
+                        renderer.discardPrimitives();
+                    }
+                    if (keep) {
+                        mergedModel = result.merged;
+                        mergedCylinders = result.mergedCylinders;
+                    }
+                    reusedDerivation = result.reusedDerivation;
+                    deriveSeconds = result.deriveSeconds;
+                    derivationBytes = worker.getDerivationBytes();
+                    if (!result.ok && stop != lParser::ParseResult::Cancelled) {
+                        errorString = result.error;
+                        ImGui::OpenPopup("Error PopUp");
+                    }
+                }
+                else {
+                    const uint64_t cylinders = worker.getCylinders();
+                    char overlay[64];
+                    snprintf(overlay, sizeof(overlay), "%llu cylinders", (unsigned long long)cylinders);
+                    ImGui::ProgressBar(expectedCylinders > 0.0 ? (float)std::min(cylinders / expectedCylinders, 1.0) : 0.0f,
+                        ImVec2(-1.0f, 0.0f), overlay);
+                    ImGui::Text("%llu symbols", (unsigned long long)worker.getSymbols());
+                    ImGui::SameLine();
+                    if (ImGui::Button("Cancel")) {
+                        worker.cancel();
+                    }
+                }
             }
 
             // Show popup with error message
@@ -317,12 +665,61 @@ void mainLoop(GLFWwindow* window) {
                 ImGui::EndPopup();
             }
 
+            if (ImGui::TreeNode("Generation Stats")) {
+                const lParser::ParseStats& stats = parseStats;
+                const uint64_t cylinders = instancedOut.nodes.empty() ? stats.cylinders : instancedOut.flatCylinders();
+                ImGui::Text("%llu cylinders, %llu symbols", (unsigned long long)cylinders, (unsigned long long)stats.symbols);
+                if (stats.result != lParser::ParseResult::Ok && stats.result != lParser::ParseResult::GrammarError) {
+                    ImGui::Text("Partial model, the generation was stopped");
+                }
+                if (mergedModel) {
+                    ImGui::Text("Merged into %llu cylinders, %.2fx fewer", (unsigned long long)mergedCylinders,
+                        mergedCylinders == 0 ? 1.0 : (double)cylinders / mergedCylinders);
+                }
+                ImGui::Text("%.3f s, %.2f ns/symbol", stats.seconds, stats.nsPerSymbol());
+                ImGui::Text("%llu rewritings replaced by their transform", (unsigned long long)stats.skippedSubtrees);
+                ImGui::Text("Max depth %u, max pushed turtles %u", stats.maxFrames, stats.maxTurtles);
+                ImGui::Text("Stack memory %zu bytes", stats.stackBytes);
+                ImGui::Text("%u threads, %u tasks", stats.threads, stats.tasks);
+                if (reusedDerivation) {
+                    ImGui::Text("Rewriting reused, %.2f MB of derivation", derivationBytes / (1024.0 * 1024.0));
+                }
+                else if (derivationBytes != 0) {
+                    ImGui::Text("Rewriting %.3f s, %.2f MB of derivation", deriveSeconds, derivationBytes / (1024.0 * 1024.0));
+                }
+                if (!instancedOut.nodes.empty()) {
+                    ImGui::Text("%zu nodes, %zu instances, %zu cylinders", instancedOut.nodes.size(),
+                        instancedOut.instances.size(), instancedOut.cylinders.size());
+                    ImGui::Text("%.2f MB instead of %.2f MB", instancedOut.bytes() / (1024.0 * 1024.0),
+                        (double)cylinders * sizeof(lParser::Cylinder) / (1024.0 * 1024.0));
+                }
+                if (skeletonOut.segmentCount() != 0) {
+                    ImGui::Text("%zu nodes, %zu segments", skeletonOut.nodes.size(), skeletonOut.segmentCount());
+                    ImGui::Text("%.2f MB instead of %.2f MB", skeletonOut.bytes() / (1024.0 * 1024.0),
+                        (double)cylinders * sizeof(lParser::Cylinder) / (1024.0 * 1024.0));
+                }
+                if (!compactOut.cylinders.empty()) {
+                    ImGui::Text("%zu quantized cylinders in %zu chunks", compactOut.size(), compactOut.chunks.size());
+                    ImGui::Text("%.2f MB instead of %.2f MB", compactOut.bytes() / (1024.0 * 1024.0),
+                        compactOut.size() * sizeof(lParser::Cylinder) / (1024.0 * 1024.0));
+                }
+                ImGui::Text("GPU: %u draws, %.2f MB", renderer.getBatchCount(), renderer.getGpuBytes() / (1024.0 * 1024.0));
+                if (grammarCompiled && ImGui::TreeNode("Folded transforms")) {
+                    ImGui::Text("Axiom: %u ops removed", grammar.axiomRemovedOps);
+                    for (size_t i = 0; i < grammar.removedOps.size(); ++i) {
+                        ImGui::Text("Rule %zu: %u ops removed", i, grammar.removedOps[i]);
+                    }
+                    ImGui::TreePop();
+                }
+                ImGui::TreePop();
+            }
+
             // Configure the rendering of the application
             ImGui::Separator();
             ImGui::Text("Render Configuration");
-            const char* modes[] = { "Lines", "Cylinders", "Cylinders Normal"};
+            const char* modes[RENDER_MODES] = { "Lines", "Cylinders", "Cylinders Normal", "Cylinder Mesh", "Cylinder Mesh Normal" };
             if (ImGui::BeginCombo("Render Mode", modes[renderMode])) {
-                for (uint32_t i = 0; i < 3; ++i) {
+                for (uint32_t i = 0; i < RENDER_MODES; ++i) {
                     const bool is_selected = (renderMode == i);
                     if (ImGui::Selectable(modes[i], is_selected)) {
                         renderMode = i;
@@ -334,6 +731,19 @@ void mainLoop(GLFWwindow* window) {
                 }
                 ImGui::EndCombo();
             }
+            // The cylinder meshes are instanced without a geometry shader
+            if (renderMode >= 3 && ImGui::SliderInt("Ring segments", &ringSegments,
+                (int)Renderer::MIN_RING_SEGMENTS, (int)Renderer::MAX_RING_SEGMENTS)) {
+                renderer.setRingSegments((uint32_t)ringSegments);
+            }
+            if (ImGui::Button("Compare render modes")) {
+                compareModes = true;
+            }
+            if (renderModeMs[1] > 0.0) {
+                for (uint32_t i = 1; i < RENDER_MODES; ++i) {
+                    ImGui::Text("%s: %.3f ms/frame", modes[i], renderModeMs[i]);
+                }
+            }
             ImGui::ColorEdit3("clear color", (float*)&clear_color);
             if (ImGui::ColorEdit3("Plant Color", (float*)&plant_color)) {
                 renderer.setPlantColor(plant_color);
@@ -380,7 +790,16 @@ void mainLoop(GLFWwindow* window) {
 
         // Render the generated model
         glEnable(GL_DEPTH_TEST);
-        renderer.render(glm::scale(camera.getProjView(), glm::vec3(scale)), renderMode);
+        const glm::mat4 projView = glm::scale(camera.getProjView(), glm::vec3(scale));
+        // The comparison is drawn over this frame, which is cleared again after it
+        if (compareModes) {
+            for (uint32_t i = 1; i < RENDER_MODES; ++i) {
+                renderModeMs[i] = renderer.timeRender(projView, i, COMPARED_FRAMES);
+            }
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            compareModes = false;
+        }
+        renderer.render(projView, renderMode);
         // Render UI
         glDisable(GL_DEPTH_TEST);
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());